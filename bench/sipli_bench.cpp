@@ -0,0 +1,353 @@
+// sipli-bench: generates synthetic SIPL workloads and runs them through sipli.
+//
+// Build: g++ -std=c++17 -O2 bench/sipli_bench.cpp -o sipli-bench
+// Run:   ./sipli-bench --sipli ./sipli [--scale N] [--repeat N] [--only name] [-- extra sipli args]
+//
+// Every workload is written to a temporary file and run with `sipli --stats`,
+// the [STATS] line sipli prints to stderr gives parse and run time and the
+// number of executed instructions, peak RSS comes from wait4(). Results are
+// printed as one JSON object per line on stdout (best of --repeat runs),
+// a readable table goes to stderr.
+#pragma region includes
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <cstdint>
+#include <chrono>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#pragma endregion includes
+using namespace std;
+
+struct Workload
+{
+    string name, desc;
+    string source;
+    uint64_t input_bytes = 0; // piped to stdin, see feed_input
+};
+
+struct Result
+{
+    int64_t parse_ns = 0, run_ns = 0, wall_ns = 0;
+    uint64_t instructions = 0, lines = 0;
+    long peak_rss_kb = 0;
+    int exit_code = 0;
+};
+
+#pragma region workloads
+// The :loop section of demo.sipl, without the PRNT
+Workload counter_loop(int scale)
+{
+    stringstream src;
+    src << "VAR INT i = 0;\n"
+        << ":loop;\n"
+        << "VAR INT i = $i 1 +;\n"
+        << "IF i < " << 200000 * scale << " : GOTO loop;\n";
+    return {"counter_loop", "tight VAR/IF/GOTO counter loop", src.str()};
+}
+
+Workload print_heavy(int scale)
+{
+    stringstream src;
+    src << "VAR INT i = 0;\n"
+        << "VAR STR name = worker;\n"
+        << "VAR INT a = 17;\n"
+        << "VAR STR b = some text;\n"
+        << ":loop;\n"
+        << "VAR INT i = $i 1 +;\n"
+        << "PRNT [$name] iteration $i: a=$a b=$b i=$i again $name/$a/$b/$i $missing;\n"
+        << "IF i < " << 50000 * scale << " : GOTO loop;\n";
+    return {"print_heavy", "PRNT with many $var interpolations", src.str()};
+}
+
+// A ring of states, every state jumps to the next one through its label
+Workload goto_states(int scale)
+{
+    const int states = 500;
+    stringstream src;
+    src << "VAR INT n = 0;\n"
+        << "VAR INT st = 0;\n";
+    for (int s = 0; s < states; s++)
+    {
+        src << ":s" << s << ";\n"
+            << "VAR INT st = $st 7 * 3 + " << states << " %;\n"
+            << "GOTO s" << (s + 1) % states << "_next;\n"
+            << ":s" << (s + 1) % states << "_next;\n";
+        if (s == states - 1)
+            src << "VAR INT n = $n 1 +;\n"
+                << "IF n < " << 100 * scale << " : GOTO s0;\n"
+                << "EXIT;\n";
+        else
+            src << "GOTO s" << s + 1 << ";\n";
+    }
+    return {"goto_states", "GOTO-heavy state machine with many labels", src.str()};
+}
+
+Workload long_rpn(int scale)
+{
+    const int terms = 100;
+    stringstream src;
+    src << "VAR INT i = 0;\n"
+        << "VAR INT x = 3;\n"
+        << "VAR INT y = 5;\n"
+        << ":loop;\n"
+        << "VAR INT i = $i 1 +;\n"
+        << "VAR INT r = $i";
+    const char *ops[] = {"+", "*", "-", "%"};
+    for (int t = 0; t < terms; t++)
+        src << " " << (t % 3 == 0 ? "$x" : t % 3 == 1 ? "$y" : to_string(t + 2)) << " " << ops[t % 4];
+    src << ";\n"
+        << "IF i < " << 20000 * scale << " : GOTO loop;\n";
+    return {"long_rpn", "long RPN expressions", src.str()};
+}
+
+// STR assignments and ==/!= comparisons, no arithmetic on the text
+Workload text_heavy(int scale)
+{
+    stringstream src;
+    src << "VAR INT i = 0;\n"
+        << "VAR STR state = waiting for the upstream connection;\n"
+        << ":loop;\n"
+        << "VAR INT i = $i 1 +;\n"
+        << "VAR STR state = connected to the upstream server now;\n"
+        << "IF state == connected to the upstream server now : VAR STR msg = handshake complete;\n"
+        << "IF state != waiting for the upstream connection : VAR STR state = waiting for the upstream connection;\n"
+        << "IF msg == handshake complete : VAR INT n = $i;\n"
+        << "IF i < " << 100000 * scale << " : GOTO loop;\n";
+    return {"text_heavy", "STR assignments and comparisons", src.str()};
+}
+
+// A log filter over input_mb of piped input, see feed_input
+Workload stdin_filter(uint64_t input_mb)
+{
+    stringstream src;
+    src << "VAR INT n = 0;\n"
+        << "VAR INT errors = 0;\n"
+        << ":top;\n"
+        << "INPT line : done;\n"
+        << "VAR INT n = $n 1 +;\n"
+        << "IF line == ERROR upstream connection reset : VAR INT errors = $errors 1 +;\n"
+        << "GOTO top;\n"
+        << ":done;\n"
+        << "PRNT $n lines, $errors errors;\n";
+    Workload w{"stdin_filter", "INPT loop over piped input", src.str()};
+    w.input_bytes = input_mb << 20;
+    return w;
+}
+
+// Mostly load time: several MB of straight line code that runs once
+Workload big_source(int scale)
+{
+    stringstream src;
+    src << "VAR INT v = 0;\n";
+    for (int l = 0; l < 100000 * scale; l++)
+    {
+        src << "_ generated statement " << l << ";\n"
+            << "VAR INT v" << l % 1000 << " = $v " << l << " + 3 *;\n";
+        if (l % 100 == 0)
+            src << ":label" << l << ";\n";
+    }
+    return {"big_source", "multi-megabyte source, measures load time", src.str()};
+}
+#pragma endregion workloads
+
+// Writes bytes of log lines to fd, one in 16 is an error line
+void feed_input(int fd, uint64_t bytes)
+{
+    string block;
+    for (int l = 0; block.size() < (1 << 16); l++)
+        block += l % 16 == 15 ? "ERROR upstream connection reset\n" : "INFO request " + to_string(l) + " handled in " + to_string(l % 97) + " ms\n";
+    for (uint64_t done = 0; done < bytes;)
+    {
+        ssize_t n = write(fd, block.data(), min<uint64_t>(block.size(), bytes - done));
+        if (n <= 0)
+            break;
+        done += n;
+    }
+}
+
+// Runs sipli on path with stdout discarded and reads the [STATS] line. The
+// workload's input is written to its stdin by a second child.
+bool run_sipli(const string &sipli, const vector<string> &extra, const string &path, uint64_t input_bytes, Result &res)
+{
+    int errpipe[2], inpipe[2];
+    if (pipe(errpipe) != 0)
+        return false;
+    if (input_bytes && pipe(inpipe) != 0)
+        return false;
+    auto start = chrono::steady_clock::now();
+    pid_t feeder = -1;
+    if (input_bytes)
+    {
+        feeder = fork();
+        if (feeder < 0)
+            return false;
+        if (feeder == 0)
+        {
+            close(inpipe[0]);
+            close(errpipe[0]);
+            close(errpipe[1]);
+            feed_input(inpipe[1], input_bytes);
+            _exit(0);
+        }
+        close(inpipe[1]);
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(input_bytes ? inpipe[0] : devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(errpipe[1], STDERR_FILENO);
+        close(errpipe[0]);
+        vector<string> args{sipli, "--stats", "-f", path};
+        args.insert(args.end(), extra.begin(), extra.end());
+        vector<char *> argv;
+        for (string &a : args)
+            argv.push_back(&a[0]);
+        argv.push_back(nullptr);
+        execv(sipli.c_str(), argv.data());
+        _exit(127);
+    }
+    close(errpipe[1]);
+    if (input_bytes)
+        close(inpipe[0]);
+    string err;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(errpipe[0], buf, sizeof(buf))) > 0)
+        err.append(buf, n);
+    close(errpipe[0]);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    res.wall_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    res.peak_rss_kb = usage.ru_maxrss;
+    res.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    if (feeder > 0)
+        waitpid(feeder, nullptr, 0);
+
+    size_t pos = err.find("[STATS]");
+    if (pos == string::npos)
+    {
+        cerr << "no [STATS] line from " << sipli << ", stderr was:\n" << err;
+        return false;
+    }
+    stringstream ss(err.substr(pos + 7, err.find('\n', pos) - pos - 7));
+    string kv;
+    while (ss >> kv)
+    {
+        size_t eq = kv.find('=');
+        string key = kv.substr(0, eq);
+        long long val = stoll(kv.substr(eq + 1));
+        if (key == "parse_ns")
+            res.parse_ns = val;
+        else if (key == "run_ns")
+            res.run_ns = val;
+        else if (key == "instructions")
+            res.instructions = val;
+        else if (key == "lines")
+            res.lines = val;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    string sipli = "./sipli";
+    string only;
+    int scale = 1, repeat = 3;
+    uint64_t input_mb = 1024;
+    vector<string> extra;
+    for (int argn = 1; argn < argc; argn++)
+    {
+        string sa = argv[argn];
+        bool has_param = argn + 1 < argc;
+        if (sa == "--sipli" && has_param)
+            sipli = argv[++argn];
+        else if (sa == "--scale" && has_param)
+            scale = max(1, atoi(argv[++argn]));
+        else if (sa == "--repeat" && has_param)
+            repeat = max(1, atoi(argv[++argn]));
+        else if (sa == "--input-mb" && has_param)
+            input_mb = max(1, atoi(argv[++argn]));
+        else if (sa == "--only" && has_param)
+            only = argv[++argn];
+        else if (sa == "--")
+        {
+            extra.assign(argv + argn + 1, argv + argc);
+            break;
+        }
+        else
+        {
+            cerr << "sipli-bench argument list\n"
+                 << "--sipli [path]  - interpreter to benchmark (default ./sipli)\n"
+                 << "--scale [n]     - multiply workload sizes by n\n"
+                 << "--repeat [n]    - runs per workload, the best one is reported (default 3)\n"
+                 << "--only [name]   - run a single workload\n"
+                 << "--input-mb [n]  - MB piped into stdin_filter (default 1024)\n"
+                 << "-- [args]       - pass the remaining arguments to sipli" << endl;
+            return sa == "-h" || sa == "--help" ? 0 : 1;
+        }
+    }
+
+    vector<Workload> workloads{counter_loop(scale), print_heavy(scale), goto_states(scale), long_rpn(scale), text_heavy(scale), big_source(scale),
+                              stdin_filter(input_mb * scale)};
+    char dir_template[] = "/tmp/sipli-bench-XXXXXX";
+    if (!mkdtemp(dir_template))
+    {
+        cerr << "Could not create a temporary directory" << endl;
+        return 1;
+    }
+    string dir = dir_template;
+    bool failed = false;
+
+    fprintf(stderr, "%-14s %14s %12s %10s %10s %10s\n", "workload", "lines/sec", "ns/exec", "parse ms", "run ms", "rss KB");
+    for (const Workload &w : workloads)
+    {
+        if (!only.empty() && w.name != only)
+            continue;
+        string path = dir + "/" + w.name + ".sipl";
+        ofstream(path) << w.source;
+
+        Result best;
+        bool ok = true;
+        for (int r = 0; r < repeat && ok; r++)
+        {
+            Result res;
+            ok = run_sipli(sipli, extra, path, w.input_bytes, res);
+            if (ok && (r == 0 || res.run_ns + res.parse_ns < best.run_ns + best.parse_ns))
+                best = res;
+        }
+        unlink(path.c_str());
+        if (!ok)
+        {
+            failed = true;
+            continue;
+        }
+        double run_s = best.run_ns / 1e9;
+        double lines_per_sec = run_s > 0 ? best.instructions / run_s : 0;
+        double ns_per_exec = best.instructions ? (double)best.run_ns / best.instructions : 0;
+        double input_mb_per_sec = run_s > 0 ? w.input_bytes / 1048576.0 / run_s : 0;
+        printf("{\"workload\":\"%s\",\"scale\":%d,\"source_bytes\":%zu,\"lines\":%llu,\"instructions\":%llu,"
+               "\"parse_ns\":%lld,\"run_ns\":%lld,\"wall_ns\":%lld,\"lines_per_sec\":%.0f,\"ns_per_exec\":%.2f,"
+               "\"input_bytes\":%llu,\"input_mb_per_sec\":%.1f,\"peak_rss_kb\":%ld,\"exit_code\":%d}\n",
+               w.name.c_str(), scale, w.source.size(), (unsigned long long)best.lines, (unsigned long long)best.instructions,
+               (long long)best.parse_ns, (long long)best.run_ns, (long long)best.wall_ns, lines_per_sec, ns_per_exec,
+               (unsigned long long)w.input_bytes, input_mb_per_sec, best.peak_rss_kb, best.exit_code);
+        fflush(stdout);
+        fprintf(stderr, "%-14s %14.0f %12.2f %10.2f %10.2f %10ld\n", w.name.c_str(), lines_per_sec, ns_per_exec,
+                best.parse_ns / 1e6, best.run_ns / 1e6, best.peak_rss_kb);
+    }
+    rmdir(dir.c_str());
+    return failed ? 1 : 0;
+}
@@ -3,14 +3,44 @@
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <regex>
 #include <string>
+#include <string_view>
+#include <cstring>
 #include <cstdlib>
+#include <cstdio>
 #include <cmath>
+#include <cstdint>
+#include <algorithm>
 #include <ctime>
 #include <exception>
 #include <random>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <csignal>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__x86_64__)
+#define SIPLI_JIT 1
+#endif
+#include "sipli.h"
 #pragma endregion includes
 using namespace std;
 #pragma region constants
@@ -32,37 +62,127 @@ enum AbstractType{
     INTEGER,
     STRING
 };
+// An interned string. A StringPool keeps one PoolStr per text, so two
+// pooled values are equal exactly when their addresses are.
+struct PoolStr
+{
+    string_view text;
+};
+// Interned strings in large blocks, freed all at once
+class StringPool
+{
+private:
+    static const size_t BLOCK = 1 << 16;
+    vector<unique_ptr<char[]>> blocks;
+    char *next = nullptr;
+    size_t left = 0;
+    unordered_map<string_view, const PoolStr *> index;
+public:
+    size_t bytes = 0; // text and PoolStr records
+    uint64_t allocs = 0; // blocks
+    const PoolStr *find(string_view text) const
+    {
+        auto it = index.find(text);
+        return it == index.end() ? nullptr : it->second;
+    }
+    const PoolStr *add(string_view text)
+    {
+        if (const PoolStr *found = find(text))
+            return found;
+        size_t need = (sizeof(PoolStr) + text.size() + alignof(PoolStr) - 1) / alignof(PoolStr) * alignof(PoolStr);
+        if (need > left)
+        {
+            size_t size = max(need, BLOCK);
+            blocks.emplace_back(new char[size]);
+            next = blocks.back().get();
+            left = size;
+            allocs++;
+        }
+        char *chars = next + sizeof(PoolStr);
+        memcpy(chars, text.data(), text.size());
+        PoolStr *str = new (next) PoolStr{string_view(chars, text.size())};
+        next += need;
+        left -= need;
+        bytes += need;
+        index.emplace(str->text, str);
+        return str;
+    }
+    void clear()
+    {
+        blocks.clear();
+        index.clear();
+        next = nullptr;
+        left = 0;
+        bytes = 0;
+        allocs = 0;
+    }
+};
+// Integers are kept native. STRING values point to a PoolStr when the
+// interpreter could intern them and use the string member otherwise.
 class AbstractValue
 {
 private:
     AbstractType type;
+    int64_t number;
     string value;
+    const PoolStr *pooled = nullptr;
 public:
     AbstractValue(){
         this->type = VOID;
+        this->number = 0;
     }
-    AbstractValue(int x){
-        this->value = to_string(x);
+    AbstractValue(int64_t x){
+        this->number = x;
         this->type = INTEGER;
     }
     AbstractValue(string x){
+        this->number = 0;
         this->value = x;
         this->type = STRING;
     }
-    int getAsInt(){
+    AbstractValue(const PoolStr *x){
+        this->number = 0;
+        this->pooled = x;
+        this->type = STRING;
+    }
+    int64_t getAsInt() const{
         if(this->type==INTEGER){
-            return stoi(value);
+            return number;
+        }
+        else if(this->type==STRING){
+            return stoll(string(view()));
         }
         else{
             throw runtime_error("Invalid type getter");
         }
     }
-    string getAsString(){
-        return value;
+    string getAsString() const{
+        if(this->type==INTEGER){
+            return to_string(number);
+        }
+        return string(view());
+    }
+    // STRING text without a copy
+    string_view view() const{
+        return pooled ? pooled->text : string_view(value);
     }
-    AbstractType getType(){
+    const PoolStr *handle() const{
+        return pooled;
+    }
+    AbstractType getType() const{
         return type;
     }
+    // getAsString without the temporary
+    void appendTo(string &out) const{
+        if(this->type==INTEGER){
+            char buf[24];
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)number);
+            out.append(buf, len);
+        }
+        else{
+            out += view();
+        }
+    }
 };
 enum SiplExprType{
     LITERAL,
@@ -100,513 +220,4870 @@ public:
     }
 };
 
+enum OpCode{
+    OP_NOP,      // empty line, comment or label
+    OP_PRNT,
+    OP_VAR_INT,
+    OP_VAR_STR,
+    OP_GOTO,
+    OP_IF,
+    OP_INPT,
+    OP_HLP,
+    OP_EXIT,
+    OP_DMP,
+    OP_RNG,
+    OP_ARR,
+    OP_SET_INT,  // VAR INT name[index]
+    OP_SET_STR,  // VAR STR name[index]
+    OP_LEN,
+    OP_FILL,
+    OP_SUM,
+    OP_MIN,
+    OP_MAX,
+    OP_SNAP,
+    // superinstructions, made by fuse_program
+    OP_INC,        // VAR INT x = $x c + (or -)
+    OP_BRANCH,     // IF ... : GOTO label
+    OP_INC_BRANCH, // OP_INC followed by OP_BRANCH
+    OP_PRNT_CONST, // PRNT without variables
+    OP_ERROR,    // compile error, reported when reached
+    OP_FALLBACK  // anything the compiler does not understand, run through exec_line
+};
+const char *const OP_NAMES[] = {"NOP", "PRNT", "VAR_INT", "VAR_STR", "GOTO", "IF", "INPT", "HLP", "EXIT", "DMP", "RNG", "ARR", "SET_INT", "SET_STR", "LEN", "FILL", "SUM", "MIN", "MAX", "SNAP", "INC", "BRANCH", "INC_BRANCH", "PRNT_CONST", "ERROR", "FALLBACK"};
+enum ExprTermKind{
+    TERM_CONST,
+    TERM_VAR,  // $name
+    TERM_NAME, // bare variable name
+    TERM_OP,
+    TERM_DROP, // pop value items, closes a $( ... ) group
+    TERM_ELEM  // replace the index on top of the stack with that element of array value
+};
+enum ExprOp{
+    EXPR_ADD,
+    EXPR_SUB,
+    EXPR_MUL,
+    EXPR_DIV,
+    EXPR_MOD,
+    EXPR_POW
+};
+// the operator tokens, in ExprOp order
+const vector<string> EXPR_OPS{"+", "-", "*", "/", "%", "**"};
+// One postfix term of a compiled VAR INT expression. value holds the
+// constant, the variable slot or the ExprOp depending on kind.
+const int EXPR_STACK_SIZE = 64;
+struct ExprTerm
+{
+    ExprTermKind kind;
+    int64_t value;
+};
 
-class Interpreter
+enum CompareOp{
+    CMP_EQ,
+    CMP_NE,
+    CMP_LT,
+    CMP_GT,
+    CMP_LE,
+    CMP_GE
+};
+
+// A piece of PRNT text. Variable pieces keep "$name" in text, which is
+// printed as is when the variable is not defined.
+struct PrintPiece
 {
-    class HelpEntry
+    string text;
+    int slot; // -1 for literal text
+    // $name[index] pieces, printed as $name followed by the brackets if
+    // name is not an array. An index out of range stops the program.
+    bool element = false;
+    int index_slot = -1;
+    int64_t index = 0;
+    size_t name_len = 0; // length of "$name" in text
+};
+
+// ARR storage. Integer arrays are contiguous int64_t so the bulk operations
+// can be vectorized.
+struct SiplArray
+{
+    AbstractType type = VOID; // VOID until declared with ARR
+    vector<int64_t> numbers;
+    vector<string> strings;
+    size_t size() const
     {
-    public:
-        string name, desc;
-        HelpEntry(string name, string desc)
-        {
-            this->name = name;
-            this->desc = desc;
-        }
-    };
-    map<string, AbstractValue> vars;
-    map<int, string> labels;
-    map<string, vector<string>> arrays;
-    vector<string> lines;
-    bool debug_verbose;
-    const vector<HelpEntry> helpData{
-        HelpEntry("PRNT [text]", "print text (supports $variables)"),
-        HelpEntry("VAR [INT|STR] [name] = [val]", "define a variable"),
-        HelpEntry("INPT [varname]", "read stdin into variable"),
-        HelpEntry("GOTO [label]", "jump to label"),
-        HelpEntry(":label", "define a label"),
-        HelpEntry("IF var [operand] val : [action]", "run action if condition met (Supported operands: == != < > <= >= )"),
-        HelpEntry("RNG [max] [var] or RNG [min] [max] [var]", "writes a random value between [min] (default 0, inclusive) and [max] (exclusive!) into a variable"),
-        HelpEntry("DMP", "dump program data (debug only)"),
-        HelpEntry("HLP", "show help message"),
-        HelpEntry("EXIT", "abort program execution"),
-        HelpEntry("_comment", "ignored line")};
+        return type == INTEGER ? numbers.size() : strings.size();
+    }
+    string getAsString(size_t i) const
+    {
+        return type == INTEGER ? to_string(numbers[i]) : strings[i];
+    }
+};
 
-private:
-    static bool starts_with(const string &s, const string &prefix)
+// One compiled line. program[i] always corresponds to lines[i], so label
+// positions and jump targets are the same for both engines.
+struct Instruction
+{
+    OpCode op = OP_NOP;
+    string text;  // trimmed source line, used for error messages and fallback
+    string name;  // variable or label name
+    int slot = -1; // variable slot of name
+    vector<ExprTerm> expr; // VAR INT right hand side
+    vector<PrintPiece> pieces; // PRNT template
+    string value; // PRNT text, VAR value, IF literal, error message
+    // IF: slot compared against value, number is the literal as an integer
+    // if it is written the way an integer would print
+    CompareOp cmp = CMP_EQ;
+    int64_t number = 0;
+    bool is_number = false;
+    int action = -1; // IF: index into actions
+    // array instructions: the array's slot, and the element index as a
+    // constant or as the slot of the variable holding it
+    int array = -1;
+    int index_slot = -1;
+    int64_t index = 0;
+    int target = -1; // GOTO, BRANCH: index of the label line, resolved at load time
+    int64_t delta = 0; // INC: added to slot
+    int min_value = 0, max_value = 0;
+    const PoolStr *str = nullptr; // VAR STR, IF ==/!=: value interned, set by intern_literals
+};
+
+// Returns the first a, b or c in [p, end), or end. Looks at 16 bytes per
+// step where SSE2 is available.
+static const char *find_any(const char *p, const char *end, char a, char b, char c)
+{
+#ifdef __SSE2__
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    while (end - p >= 16)
     {
-        return s.find(prefix) == 0;
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)), _mm_cmpeq_epi8(chunk, vc));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
     }
-    int bounded_rand(int min, int max)
+#endif
+    for (; p < end; p++)
     {
-        return min + (rand() % (max - min));
+        if (*p == a || *p == b || *p == c)
+            return p;
     }
-    static string trim(const string &s)
+    return end;
+}
+
+// A statement of the program, trimmed and without its ';'. text points into
+// the source buffer, which has to outlive the run.
+struct SourceLine
+{
+    string_view text;
+    int line;      // line number in the source file, starting at 1
+    size_t offset; // byte offset of text in the source
+};
+
+// A source file mapped into memory, or read once if it can not be mapped
+class SourceFile
+{
+private:
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    string fallback;
+public:
+    SourceFile() = default;
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+    ~SourceFile()
     {
-        size_t start = s.find_first_not_of(" \t\n\r");
-        size_t end = s.find_last_not_of(" \t\n\r");
-        return (start == string::npos) ? "" : s.substr(start, end - start + 1);
+        if (mapped)
+            munmap((void *)data, size);
     }
-    vector<string> split(const string &str, char delimiter)
+    bool open(const string &path)
     {
-        vector<string> result;
-        stringstream ss(str);
-        string item;
-        debug_print("Splitting str: " + str);
-        while (getline(ss, item, delimiter))
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
         {
-            result.push_back(item);
-            debug_print("Got tok: " + item);
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                data = (const char *)p;
+                size = st.st_size;
+                mapped = true;
+                ::close(fd);
+                return true;
+            }
         }
-        return result;
+        // pipes and empty files
+        char chunk[1 << 16];
+        ssize_t n;
+        while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+            fallback.append(chunk, n);
+        ::close(fd);
+        data = fallback.data();
+        size = fallback.size();
+        return n == 0;
     }
-    void handle_echo(const string &text)
+    string_view text() const
     {
-        regex var_pattern(R"(\$(\w+))");
-        string result;
-        sregex_iterator it(text.begin(), text.end(), var_pattern);
-        sregex_iterator end;
+        return string_view(data, size);
+    }
+};
 
-        size_t last_pos = 0;
-        while (it != end)
-        {
-            result += text.substr(last_pos, it->position() - last_pos);
-            string varname = (*it)[1];
-            result += vars.count(varname) ? vars[varname].getAsString() : "$" + varname;
-            last_pos = it->position() + it->length();
-            ++it;
-        }
-        result += text.substr(last_pos);
-        cout << result << endl;
+enum FlushPolicy{
+    FLUSH_AUTO, // per line on a terminal, when full otherwise
+    FLUSH_LINE,
+    FLUSH_FULL
+};
+// Builds and prints a debug message only when debug output is on. Defining
+// SIPLI_NO_DEBUG compiles debug messages out completely.
+#ifdef SIPLI_NO_DEBUG
+#define DEBUG_PRINT(msg) do { } while (0)
+#else
+#define DEBUG_PRINT(msg) do { if (this->debug_verbose) debug_print(msg); } while (0)
+#endif
+
+// Buffered writer for a file descriptor. Lines are collected in buf and
+// written with one write() per flush instead of one per line.
+class OutputWriter
+{
+private:
+    int fd;
+    bool line_flush;
+    string buf;
+    string *capture; // flushes append here instead of writing to fd
+    function<void(string_view)> sink; // or are passed to sink
+public:
+    static const size_t CAPACITY = 1 << 16;
+    OutputWriter(int fd, FlushPolicy policy = FLUSH_AUTO)
+    {
+        this->fd = fd;
+        this->capture = nullptr;
+        if (policy == FLUSH_AUTO)
+            this->line_flush = isatty(fd);
+        else
+            this->line_flush = policy == FLUSH_LINE;
+        buf.reserve(CAPACITY);
     }
-    void debug_print(string t)
+    // collects the output in capture, for --batch
+    OutputWriter(string &capture)
     {
-        if (this->debug_verbose)
-            cout << "[DEBUG] " << t << endl;
+        this->fd = -1;
+        this->capture = &capture;
+        this->line_flush = false;
     }
-    void print_help()
+    ~OutputWriter()
     {
-        int mnlen = 0;
-        for (int i = 0; i < helpData.size(); i++)
-        {
-            HelpEntry entry = helpData[i];
-            if (entry.name.size() > mnlen)
-                mnlen = entry.name.size();
-        }
-        cout << "SIPL Token list\n\n";
-        for (int i = 0; i < helpData.size(); i++)
-        {
-            HelpEntry entry = helpData[i];
-            cout << entry.name << ((string) " " * (mnlen - entry.name.size() + 2)) << " - " << entry.desc << endl;
-        }
+        flush();
     }
-    void error(const string &msg, const string &line = "")
+    // hands every flushed chunk of whole lines to sink, for sipli::Context
+    void set_sink(function<void(string_view)> sink)
     {
-        cerr << "[ERROR] " << msg;
-        if (!line.empty())
-            cerr << " | Line: \"" << line << "\"";
-        cerr << endl;
+        flush();
+        this->fd = -1;
+        this->capture = nullptr;
+        this->sink = move(sink);
+        this->line_flush = false;
     }
-
-public:
-    Interpreter(bool debug = 0)
+    // the pending output, text can be rendered into it directly
+    string &buffer()
     {
-        this->debug_verbose = debug;
+        return buf;
     }
-    int addLines(string l){
-        int ret=lines.size();
-        for (string line : split(l, ';'))
+    void write(const string &text)
+    {
+        buf += text;
+    }
+    void end_line()
+    {
+        buf += '\n';
+        if (line_flush || buf.size() >= CAPACITY)
+            flush();
+    }
+    void write_line(const string &text)
+    {
+        buf += text;
+        end_line();
+    }
+    void flush()
+    {
+        if (capture)
         {
-            if (line.empty())
-                continue;
-            if (line[0] == '_')
-                continue;
-            lines.push_back(line);
+            *capture += buf;
+            buf.clear();
+            return;
         }
-        return ret;
-    }
-    int find_label(string name){
-        debug_print("Checking label " + name);
-        for(pair<int,string> label:labels){
-            if(label.second==name) return label.first;
+        if (fd < 0)
+        {
+            if (sink && !buf.empty())
+                sink(buf);
+            buf.clear();
+            return;
         }
-        debug_print("Label not found");
-        return -1;
-    }
-    string preprocess_expr(const string& expr) {
-        string result;
-        for (size_t i = 0; i < expr.size(); ++i) {
-            if (expr[i] == '$') {
-                i++;
-                string varname;
-                while (i < expr.size() && (isalnum(expr[i]) || expr[i] == '_')) {
-                    varname += expr[i];
-                    ++i;
-                }
-                --i;
-                if (vars.count(varname)) {
-                    result += vars[varname].getAsString();
-                }else {
-                    error("Undefined variable: " + varname);
-                }
-            }else {
-                result += expr[i];
-            }
+        size_t done = 0;
+        while (done < buf.size())
+        {
+            ssize_t n = ::write(fd, buf.data() + done, buf.size() - done);
+            if (n <= 0)
+                break;
+            done += n;
         }
-        return result;
+        buf.clear();
     }
+};
 
-    string eval_expr(const string &s)
+// Buffered reader for a file descriptor. Input is read in large blocks and
+// next() hands out lines as views into the buffer, which stay valid until
+// the next call.
+class InputReader
+{
+private:
+    int fd;
+    vector<char> buf;
+    size_t start = 0, end = 0; // unread input is buf[start, end)
+    bool eof = false;
+public:
+    static const size_t CAPACITY = 1 << 20;
+    InputReader(int fd) : fd(fd), buf(CAPACITY)
     {
-        if (s.empty())
-            return "";
-        string replaced = preprocess_expr(s);
-        vector<string> toks = split(replaced, ' ');
-        vector<int> stack;
-        for (int ti = 0; ti < toks.size(); ti++)
+    }
+    // false at the end of the input, like getline the last line does not
+    // need a newline
+    bool next(string_view &line)
+    {
+        size_t scanned = start;
+        while (true)
         {
-            string t = toks[ti];
-            if (isdigit(t[0]) || (t[0] == '-' && t.size() > 1))
-            {
-                stack.push_back(stoi(t));
-            }
-            else if (t[0] == '$')
-            {
-                if (t[1] == '(')
-                {
-                    debug_print("Found possible expression definition;");
-                    int sti = ti;
-                    string expr = "";
-                    bool found = false;
-                    while (!found)
-                    {
-                        string tok = toks[sti];
-                        for (int ci = 0; ci < tok.size(); ci++)
-                        {
-                            char c = tok[ci];
-                            if (sti == ti && ci <= 1)
-                                continue;
-                            if (c == ')')
-                            {
-                                found = 1;
-                                break;
-                            }
-                            else if (c == ';')
-                            {
-                                found = 0;
-                                break;
-                            }
-                            else
-                            {
-                                expr += c;
-                            }
-                        }
-                        expr += " ";
-                        sti++;
-                    }
-                    if (!found)
-                    {
-                        error("Unmatched () in expr " + s);
-                        return "";
-                    }
-                    else
-                    {
-                        ti = sti - 1;
-                        return eval_expr(expr);
-                    }
-                }
-                else
-                {
-                    string varname = t.substr(1);
-                    if (vars.count(varname))
-                    {
-                        stack.push_back(stoi(vars[varname].getAsString()));
-                    }
-                    else
-                    {
-                        throw runtime_error("Undefined variable: " + varname);
-                    }
-                }
-            }
-            else if (vars.count(t))
+            const char *nl = (const char *)memchr(buf.data() + scanned, '\n', end - scanned);
+            if (nl)
             {
-                stack.push_back(stoi(vars[t].getAsString()));
+                size_t len = nl - buf.data() - start;
+                line = string_view(buf.data() + start, len);
+                start += len + 1;
+                return true;
             }
-            else if (t == "+" || t == "-" || t == "*" || t == "/" || t == "%" || t == "**")
+            scanned = end;
+            if (eof)
             {
-                if (stack.size() < 2)
-                    throw runtime_error("Not enough operands for: " + t);
-                int b = stack.back();
-                stack.pop_back();
-                int a = stack.back();
-                stack.pop_back();
-                if (t == "+")
-                    stack.push_back(a + b);
-                else if (t == "-")
-                    stack.push_back(a - b);
-                else if (t == "*")
-                    stack.push_back(a * b);
-                else if (t == "/")
-                    stack.push_back(b != 0 ? a / b : 0);
-                else if (t == "%")
-                    stack.push_back(a % b);
-                else if (t == "**")
-                    stack.push_back((int)pow(a, b));
+                line = string_view(buf.data() + start, end - start);
+                start = end;
+                return !line.empty();
             }
-            else
+            // keep the partial line and make room behind it, a line longer
+            // than the buffer grows it
+            if (start > 0)
             {
-                throw runtime_error("Unsupported token: " + t);
+                memmove(buf.data(), buf.data() + start, end - start);
+                end -= start;
+                scanned -= start;
+                start = 0;
             }
+            if (end == buf.size())
+                buf.resize(buf.size() * 2);
+            ssize_t n = ::read(fd, buf.data() + end, buf.size() - end);
+            if (n > 0)
+                end += n;
+            else if (n == 0 || errno != EINTR)
+                eof = true;
         }
+    }
+};
 
-        return stack.empty() ? "" : to_string(stack[0]);
+// --profile data, indexed like Interpreter::program
+struct Profiler
+{
+    vector<uint64_t> counts;
+    vector<uint64_t> cycles;
+    unordered_map<uint64_t, uint64_t> jumps; // from << 32 | to -> count
+    uint64_t run_cycles = 0;
+    int64_t run_ns = 0;
+    // cheap timestamp, cycles where the CPU has a counter
+    static uint64_t now()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
     }
-    int exec_line(string line, int &i)
+    void reset(size_t size)
     {
-        try
-        {
-            if (line.empty() || line[0] == ':' || line[0] == '_')
-            {
-                debug_print("Line empty");
-                return 1;
-            }
-            vector<string> arg = split(line, ' ');
+        counts.assign(size, 0);
+        cycles.assign(size, 0);
+        jumps.clear();
+        run_cycles = 0;
+        run_ns = 0;
+    }
+    void record(int from, int next, uint64_t spent)
+    {
+        counts[from]++;
+        cycles[from] += spent;
+        if (next != from + 1)
+            jumps[(uint64_t)from << 32 | (uint32_t)next]++;
+    }
+    double ns_per_cycle() const
+    {
+        return run_cycles ? (double)run_ns / run_cycles : 0;
+    }
+};
+
+// One executed instruction as recorded by --trace
+struct TraceRecord
+{
+    uint64_t seq;
+    int line;     // index into Interpreter::lines
+    OpCode op;
+    int slot;     // variable the instruction wrote or compared, -1 if none
+    AbstractType type;
+    int64_t number;
+    char text[16]; // start of a string value
+};
+// The last SIZE records, overwritten in a circle. Recording is a few stores,
+// messages are only formatted when the ring is printed.
+class TraceRing
+{
+private:
+    vector<TraceRecord> records;
+    uint64_t next = 0;
+public:
+    static const size_t SIZE = 4096;
+    TraceRing() : records(SIZE)
+    {
+    }
+    TraceRecord &push()
+    {
+        TraceRecord &r = records[next & (SIZE - 1)];
+        r.seq = next++;
+        return r;
+    }
+    uint64_t total() const
+    {
+        return next;
+    }
+    // oldest first
+    vector<const TraceRecord *> recent() const
+    {
+        vector<const TraceRecord *> ret;
+        for (uint64_t seq = next > SIZE ? next - SIZE : 0; seq < next; seq++)
+            ret.push_back(&records[seq & (SIZE - 1)]);
+        return ret;
+    }
+};
+
+// xoshiro256** seeded through splitmix64. Every interpreter owns one, so
+// runs can be replayed with --seed and interpreters do not share state.
+class Random
+{
+private:
+    uint64_t s[4];
+    static uint64_t rotl(uint64_t x, int k)
+    {
+        return (x << k) | (x >> (64 - k));
+    }
+public:
+    explicit Random(uint64_t seed = 0)
+    {
+        reseed(seed);
+    }
+    void reseed(uint64_t seed)
+    {
+        for (uint64_t &word : s)
+        {
+            uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            word = z ^ (z >> 31);
+        }
+    }
+    uint64_t next()
+    {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+    // Uniform in [min, max) without modulo bias (Lemire's multiply and reject)
+    int64_t bounded(int64_t min, int64_t max)
+    {
+        uint64_t range = (uint64_t)max - (uint64_t)min;
+        return min + draw(range, (0 - range) % range);
+    }
+    // bounded() for n values, the rejection threshold is computed once
+    void fill(int64_t *out, size_t n, int64_t min, int64_t max)
+    {
+        uint64_t range = (uint64_t)max - (uint64_t)min;
+        uint64_t threshold = (0 - range) % range;
+        for (size_t i = 0; i < n; i++)
+            out[i] = min + draw(range, threshold);
+    }
+private:
+    uint64_t draw(uint64_t range, uint64_t threshold)
+    {
+        unsigned __int128 m = (unsigned __int128)next() * range;
+        while ((uint64_t)m < threshold)
+            m = (unsigned __int128)next() * range;
+        return m >> 64;
+    }
+};
+
+// Writes a temporary file and renames it over path, so a reader never sees
+// half a file
+static bool write_file(const string &path, string_view data)
+{
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    ::close(fd);
+    if (done != data.size() || rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --metrics counters of one interpreter. Only the interpreter's thread
+// updates them and MetricsExporter reads them from its own thread, relaxed
+// atomics make that safe without a locked instruction per update.
+struct Metrics
+{
+    static const int OPS = OP_FALLBACK + 1;
+    // bucket bounds 100 ns, 1 us, ... 10 s, and +Inf
+    static const int BUCKETS = 9;
+    // instruction latency is timed for one instruction in SAMPLE
+    static const uint64_t SAMPLE = 256;
+    struct Histogram
+    {
+        atomic<uint64_t> counts[BUCKETS + 1] = {};
+        atomic<uint64_t> sum_ns{0}, count{0};
+    };
+    atomic<uint64_t> ops[OPS] = {};
+    Histogram latency, input_wait;
+    atomic<uint64_t> waiting{0}; // 1 while INPT blocks
+    // gauges, recomputed by the interpreter when refresh is set
+    atomic<uint64_t> variables{0}, variable_bytes{0}, arrays{0}, array_bytes{0}, pool_bytes{0};
+    atomic<bool> refresh{true};
+
+    static void add(atomic<uint64_t> &counter, uint64_t n = 1)
+    {
+        counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    static void set(atomic<uint64_t> &gauge, uint64_t value)
+    {
+        gauge.store(value, memory_order_relaxed);
+    }
+    static void observe(Histogram &h, uint64_t ns)
+    {
+        int bucket = 0;
+        for (uint64_t bound = 100; bucket < BUCKETS && ns > bound; bound *= 10)
+            bucket++;
+        add(h.counts[bucket]);
+        add(h.sum_ns, ns);
+        add(h.count);
+    }
+    // Prometheus text format
+    string render() const
+    {
+        string text;
+        auto get = [](const atomic<uint64_t> &v) { return to_string(v.load(memory_order_relaxed)); };
+        auto header = [&text](const char *name, const char *type, const char *help) {
+            text += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+        };
+        auto histogram = [&](const char *name, const Histogram &h) {
+            uint64_t total = 0;
+            double bound = 1e-7;
+            char le[32];
+            for (int b = 0; b <= BUCKETS; b++, bound *= 10)
+            {
+                total += h.counts[b].load(memory_order_relaxed);
+                snprintf(le, sizeof(le), "%g", bound);
+                text += string(name) + "_bucket{le=\"" + (b == BUCKETS ? "+Inf" : le) + "\"} " + to_string(total) + "\n";
+            }
+            snprintf(le, sizeof(le), "%.9f", h.sum_ns.load(memory_order_relaxed) / 1e9);
+            text += string(name) + "_sum " + le + "\n" + name + "_count " + get(h.count) + "\n";
+        };
+        header("sipli_instructions_total", "counter", "Executed instructions by opcode, fused instructions count once.");
+        for (int op = 0; op < OPS; op++)
+            text += string("sipli_instructions_total{op=\"") + OP_NAMES[op] + "\"} " + get(ops[op]) + "\n";
+        header("sipli_instruction_latency_seconds", "histogram", "Time of one instruction, sampled every 256 instructions.");
+        histogram("sipli_instruction_latency_seconds", latency);
+        header("sipli_input_wait_seconds", "histogram", "Time INPT waited for a line.");
+        histogram("sipli_input_wait_seconds", input_wait);
+        header("sipli_input_waiting", "gauge", "1 while INPT waits for a line.");
+        text += "sipli_input_waiting " + get(waiting) + "\n";
+        header("sipli_variables", "gauge", "Defined variables.");
+        text += "sipli_variables " + get(variables) + "\n";
+        header("sipli_variable_bytes", "gauge", "Bytes of variable values, pooled strings excluded.");
+        text += "sipli_variable_bytes " + get(variable_bytes) + "\n";
+        header("sipli_arrays", "gauge", "Declared arrays.");
+        text += "sipli_arrays " + get(arrays) + "\n";
+        header("sipli_array_bytes", "gauge", "Bytes of array elements.");
+        text += "sipli_array_bytes " + get(array_bytes) + "\n";
+        header("sipli_string_pool_bytes", "gauge", "Bytes of interned strings.");
+        text += "sipli_string_pool_bytes " + get(pool_bytes) + "\n";
+        return text;
+    }
+};
+
+// Rewrites path with the metrics every interval and once more when it is
+// destroyed, asking the interpreter for fresh gauges each time
+class MetricsExporter
+{
+private:
+    Metrics &metrics;
+    string path;
+    chrono::milliseconds interval;
+    mutex lock;
+    condition_variable wake;
+    bool done = false;
+    thread worker;
+public:
+    MetricsExporter(Metrics &metrics, string path, int interval_ms) : metrics(metrics), path(move(path)), interval(interval_ms)
+    {
+        worker = thread([this] { run(); });
+    }
+    ~MetricsExporter()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            done = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+private:
+    void run()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            bool last = wake.wait_for(guard, interval, [this] { return done; });
+            write_file(path, metrics.render());
+            metrics.refresh.store(true, memory_order_relaxed);
+            if (last)
+                return;
+        }
+    }
+};
+
+// .siplc files: a CacheHeader, the sections it points to and a blob with
+// every string. Records are plain structs in host byte order, strings are
+// offsets into the blob, so the file is read from one mapping.
+const char SIPLC_MAGIC[8] = {'S', 'I', 'P', 'L', 'C', 0, 0, 0};
+const uint32_t SIPLC_FORMAT = 2;
+enum CacheSection{
+    CS_LINES,
+    CS_NAMES,
+    CS_LABELS,
+    CS_PROGRAM,
+    CS_ACTIONS,
+    CS_TERMS,
+    CS_PIECES,
+    CS_DIAGNOSTICS,
+    CS_BLOB,
+    CS_COUNT
+};
+struct CacheStr
+{
+    uint32_t off, len;
+};
+struct CacheHeader
+{
+    char magic[8];
+    uint32_t format, opt_level;
+    uint64_t source_hash;
+    uint64_t offset[CS_COUNT], count[CS_COUNT]; // count is bytes for CS_BLOB
+};
+struct CacheLine
+{
+    CacheStr text;
+    int32_t line, pad;
+    uint64_t offset;
+};
+struct CacheLabel
+{
+    int32_t index;
+    CacheStr name;
+};
+struct CacheTerm
+{
+    int32_t kind, pad;
+    int64_t value;
+};
+struct CachePiece
+{
+    CacheStr text;
+    int32_t slot, index_slot;
+    int64_t index;
+    uint64_t name_len;
+    uint32_t element, pad;
+};
+struct CacheInstr
+{
+    uint32_t op, cmp, is_number;
+    int32_t slot, action, array, index_slot, target, min_value, max_value;
+    int64_t number, index, delta;
+    CacheStr text, name, value;
+    uint32_t expr_first, expr_count, pieces_first, pieces_count;
+};
+
+class CacheWriter
+{
+    string blob;
+    unordered_map<string, CacheStr> known; // the same text is stored once
+public:
+    vector<CacheLine> lines;
+    vector<CacheStr> names, diagnostics;
+    vector<CacheLabel> labels;
+    vector<CacheInstr> program, actions;
+    vector<CacheTerm> terms;
+    vector<CachePiece> pieces;
+    CacheStr str(string_view text)
+    {
+        auto it = known.find(string(text));
+        if (it != known.end())
+            return it->second;
+        CacheStr ref{(uint32_t)blob.size(), (uint32_t)text.size()};
+        blob.append(text);
+        known[string(text)] = ref;
+        return ref;
+    }
+    CacheInstr instr(const Instruction &ins)
+    {
+        CacheInstr rec{(uint32_t)ins.op, (uint32_t)ins.cmp, ins.is_number, ins.slot, ins.action, ins.array, ins.index_slot,
+                       ins.target, ins.min_value, ins.max_value, ins.number, ins.index, ins.delta,
+                       str(ins.text), str(ins.name), str(ins.value),
+                       (uint32_t)terms.size(), (uint32_t)ins.expr.size(), (uint32_t)pieces.size(), (uint32_t)ins.pieces.size()};
+        for (const ExprTerm &t : ins.expr)
+            terms.push_back({t.kind, 0, t.value});
+        for (const PrintPiece &p : ins.pieces)
+            pieces.push_back({str(p.text), p.slot, p.index_slot, p.index, p.name_len, p.element, 0});
+        return rec;
+    }
+    bool write(const string &path, uint64_t hash, int opt_level)
+    {
+        CacheHeader header{};
+        memcpy(header.magic, SIPLC_MAGIC, 8);
+        header.format = SIPLC_FORMAT;
+        header.opt_level = opt_level;
+        header.source_hash = hash;
+        string file(sizeof(header), '\0');
+        auto section = [&](CacheSection id, const void *data, size_t count, size_t size) {
+            file.resize((file.size() + 7) / 8 * 8, '\0');
+            header.offset[id] = file.size();
+            header.count[id] = count;
+            file.append((const char *)data, count * size);
+        };
+        section(CS_LINES, lines.data(), lines.size(), sizeof(CacheLine));
+        section(CS_NAMES, names.data(), names.size(), sizeof(CacheStr));
+        section(CS_LABELS, labels.data(), labels.size(), sizeof(CacheLabel));
+        section(CS_PROGRAM, program.data(), program.size(), sizeof(CacheInstr));
+        section(CS_ACTIONS, actions.data(), actions.size(), sizeof(CacheInstr));
+        section(CS_TERMS, terms.data(), terms.size(), sizeof(CacheTerm));
+        section(CS_PIECES, pieces.data(), pieces.size(), sizeof(CachePiece));
+        section(CS_DIAGNOSTICS, diagnostics.data(), diagnostics.size(), sizeof(CacheStr));
+        section(CS_BLOB, blob.data(), blob.size(), 1);
+        memcpy(&file[0], &header, sizeof(header));
+        return write_file(path, file);
+    }
+};
+
+// Reads a mapped .siplc file. Out of range references clear ok.
+class CacheReader
+{
+    string_view data;
+public:
+    CacheHeader header{};
+    bool ok = true;
+    CacheReader(string_view data)
+    {
+        this->data = data;
+        if (data.size() >= sizeof(header))
+            memcpy(&header, data.data(), sizeof(header));
+    }
+    bool valid()
+    {
+        static const size_t sizes[CS_COUNT] = {sizeof(CacheLine), sizeof(CacheStr), sizeof(CacheLabel), sizeof(CacheInstr),
+                                               sizeof(CacheInstr), sizeof(CacheTerm), sizeof(CachePiece), sizeof(CacheStr), 1};
+        if (data.size() < sizeof(header) || memcmp(header.magic, SIPLC_MAGIC, 8) != 0 || header.format != SIPLC_FORMAT)
+            return false;
+        for (int id = 0; id < CS_COUNT; id++)
+        {
+            if (header.offset[id] > data.size() || header.count[id] > (data.size() - header.offset[id]) / sizes[id])
+                return false;
+        }
+        return true;
+    }
+    string_view str(CacheStr ref)
+    {
+        if ((uint64_t)ref.off + ref.len > header.count[CS_BLOB])
+        {
+            ok = false;
+            return string_view();
+        }
+        return data.substr(header.offset[CS_BLOB] + ref.off, ref.len);
+    }
+    size_t count(CacheSection id) const
+    {
+        return header.count[id];
+    }
+    // Record i of a section, i < count(id). Copied out, the mapping is not aligned for T.
+    template <typename T>
+    T at(CacheSection id, size_t i) const
+    {
+        T ret;
+        memcpy(&ret, data.data() + header.offset[id] + i * sizeof(T), sizeof(T));
+        return ret;
+    }
+    Instruction instr(size_t i, CacheSection id)
+    {
+        CacheInstr rec = at<CacheInstr>(id, i);
+        Instruction ins;
+        ins.op = (OpCode)rec.op;
+        ins.cmp = (CompareOp)rec.cmp;
+        ins.is_number = rec.is_number;
+        ins.slot = rec.slot;
+        ins.action = rec.action;
+        ins.array = rec.array;
+        ins.index_slot = rec.index_slot;
+        ins.target = rec.target;
+        ins.min_value = rec.min_value;
+        ins.max_value = rec.max_value;
+        ins.number = rec.number;
+        ins.index = rec.index;
+        ins.delta = rec.delta;
+        ins.text = string(str(rec.text));
+        ins.name = string(str(rec.name));
+        ins.value = string(str(rec.value));
+        if ((uint64_t)rec.expr_first + rec.expr_count > count(CS_TERMS) || (uint64_t)rec.pieces_first + rec.pieces_count > count(CS_PIECES))
+        {
+            ok = false;
+            return ins;
+        }
+        ins.expr.reserve(rec.expr_count);
+        for (uint32_t t = 0; t < rec.expr_count; t++)
+        {
+            CacheTerm term = at<CacheTerm>(CS_TERMS, rec.expr_first + t);
+            ins.expr.push_back({(ExprTermKind)term.kind, term.value});
+        }
+        for (uint32_t p = 0; p < rec.pieces_count; p++)
+        {
+            CachePiece c = at<CachePiece>(CS_PIECES, rec.pieces_first + p);
+            PrintPiece piece{string(str(c.text)), c.slot};
+            piece.element = c.element;
+            piece.index_slot = c.index_slot;
+            piece.index = c.index;
+            piece.name_len = c.name_len;
+            ins.pieces.push_back(piece);
+        }
+        return ins;
+    }
+};
+
+// Snapshots (SNAP, DMP file, --snapshot-on-exit): a SnapHeader, one SnapVar
+// per variable slot and a blob with the names, strings and array elements.
+// INT arrays are stored as int64_t runs, 8 byte aligned.
+const char SNAP_MAGIC[8] = {'S', 'I', 'P', 'L', 'S', 'N', 'A', 'P'};
+const uint32_t SNAP_FORMAT = 1;
+struct SnapStr
+{
+    uint64_t off, len;
+};
+struct SnapHeader
+{
+    char magic[8];
+    uint32_t format, pad;
+    uint64_t program_hash; // Interpreter::source_hash of the program
+    int64_t ip;            // line to continue at
+    uint64_t var_count, vars_offset, blob_offset, blob_size;
+};
+struct SnapVar
+{
+    SnapStr name;
+    uint32_t type, array_type; // AbstractType of the variable and of the array in the slot
+    int64_t number;
+    SnapStr text;
+    uint64_t array_size, array_offset; // blob offset of int64_t or SnapStr elements
+};
+
+// Checks the layout of a snapshot and reads its header
+static bool read_snapshot_header(string_view data, SnapHeader &header)
+{
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    return memcmp(header.magic, SNAP_MAGIC, 8) == 0 && header.format == SNAP_FORMAT &&
+           header.vars_offset <= data.size() && header.var_count <= (data.size() - header.vars_offset) / sizeof(SnapVar) &&
+           header.blob_offset <= data.size() && header.blob_size <= data.size() - header.blob_offset;
+}
+static bool snapshot_range(const SnapHeader &header, uint64_t off, uint64_t count, uint64_t size)
+{
+    return off <= header.blob_size && count <= (header.blob_size - off) / size;
+}
+
+// Set by SIGINT and SIGTERM with --snapshot-on-exit, the running line stops
+// and the state is saved
+static volatile sig_atomic_t stop_requested = 0;
+
+// How Interpreter::step stopped
+enum RunState{
+    RUN_DONE,       // ran off the end or stopped on an error
+    RUN_EXIT,       // EXIT
+    RUN_WAIT_INPUT, // INPT with an empty inbox
+    RUN_BUDGET      // used up the instruction budget
+};
+
+// Machine code for one --jit region, built by Interpreter::jit_compile. The
+// region works on a copy of its integer variables, regs[k] is vars[slots[k]].
+struct JitRegion
+{
+    typedef int (*Entry)(int64_t *regs, uint64_t *executed); // returns the line to continue at
+    void *code = nullptr;
+    size_t size = 0;
+    int start = 0, end = 0; // lines [start, end)
+    vector<int> slots;
+    vector<int64_t> regs;
+    uint64_t entries = 0;
+    ~JitRegion()
+    {
+        if (code)
+            munmap(code, size);
+    }
+    Entry entry() const
+    {
+        return (Entry)code;
+    }
+};
+
+// Just enough of x86-64 for the JIT templates. The region keeps regs in rbx,
+// the executed counter pointer in r12 and the count in r13, expressions keep
+// their top in rax and the rest on the machine stack.
+class X64Emitter
+{
+public:
+    vector<uint8_t> code;
+    void bytes(initializer_list<uint8_t> b)
+    {
+        code.insert(code.end(), b);
+    }
+    void imm32(int32_t v)
+    {
+        for (int b = 0; b < 4; b++)
+            code.push_back((uint32_t)v >> (8 * b));
+    }
+    void imm64(int64_t v)
+    {
+        for (int b = 0; b < 8; b++)
+            code.push_back((uint64_t)v >> (8 * b));
+    }
+    void prologue()
+    {
+        bytes({0x53, 0x41, 0x54, 0x41, 0x55}); // push rbx; push r12; push r13
+        bytes({0x48, 0x89, 0xFB});             // mov rbx, rdi
+        bytes({0x49, 0x89, 0xF4});             // mov r12, rsi
+        bytes({0x4D, 0x8B, 0x2C, 0x24});       // mov r13, [r12]
+    }
+    void epilogue()
+    {
+        bytes({0x4D, 0x89, 0x2C, 0x24});       // mov [r12], r13
+        bytes({0x41, 0x5D, 0x41, 0x5C, 0x5B}); // pop r13; pop r12; pop rbx
+        bytes({0xC3});                         // ret
+    }
+    void count(int lines) // add r13, lines
+    {
+        bytes({0x49, 0x83, 0xC5, (uint8_t)lines});
+    }
+    void load_reg(int k) // mov rax, [rbx + 8k]
+    {
+        bytes({0x48, 0x8B, 0x83});
+        imm32(8 * k);
+    }
+    void store_reg(int k) // mov [rbx + 8k], rax
+    {
+        bytes({0x48, 0x89, 0x83});
+        imm32(8 * k);
+    }
+    void add_reg(int k, int64_t v)
+    {
+        if (v == (int32_t)v)
+        {
+            bytes({0x48, 0x81, 0x83}); // add qword [rbx + 8k], imm32
+            imm32(8 * k);
+            imm32(v);
+        }
+        else
+        {
+            load_const(v);
+            bytes({0x48, 0x01, 0x83}); // add [rbx + 8k], rax
+            imm32(8 * k);
+        }
+    }
+    void load_const(int64_t v) // mov rax, imm64
+    {
+        bytes({0x48, 0xB8});
+        imm64(v);
+    }
+    void push_rax()
+    {
+        bytes({0x50});
+    }
+    void pop_rax()
+    {
+        bytes({0x58});
+    }
+    void rcx_from_rax() // mov rcx, rax
+    {
+        bytes({0x48, 0x89, 0xC1});
+    }
+    void load_rsp(int k) // mov rax, [rsp + 8k]
+    {
+        bytes({0x48, 0x8B, 0x84, 0x24});
+        imm32(8 * k);
+    }
+    void add_rsp(int32_t n)
+    {
+        bytes({0x48, 0x81, 0xC4});
+        imm32(n);
+    }
+    void sub_rsp(int32_t n)
+    {
+        bytes({0x48, 0x81, 0xEC});
+        imm32(n);
+    }
+    void cmp_rax_rcx()
+    {
+        bytes({0x48, 0x39, 0xC8});
+    }
+    // rax = rax op rcx, the same results as Interpreter::apply_op
+    void op(int op, int64_t (*pow_fn)(int64_t, int64_t), bool misaligned)
+    {
+        switch (op)
+        {
+        case EXPR_ADD:
+            bytes({0x48, 0x01, 0xC8}); // add rax, rcx
+            break;
+        case EXPR_SUB:
+            bytes({0x48, 0x29, 0xC8}); // sub rax, rcx
+            break;
+        case EXPR_MUL:
+            bytes({0x48, 0x0F, 0xAF, 0xC1}); // imul rax, rcx
+            break;
+        case EXPR_DIV:
+        case EXPR_MOD:
+        {
+            bytes({0x48, 0x85, 0xC9});       // test rcx, rcx
+            size_t zero = jcc(0x84);         // jz zero
+            bytes({0x48, 0x83, 0xF9, 0xFF}); // cmp rcx, -1
+            size_t minus_one = jcc(0x84);    // je minus_one
+            bytes({0x48, 0x99, 0x48, 0xF7, 0xF9}); // cqo; idiv rcx
+            if (op == EXPR_MOD)
+                bytes({0x48, 0x89, 0xD0}); // mov rax, rdx
+            size_t done = jmp();
+            patch(minus_one, code.size());
+            if (op == EXPR_DIV)
+            {
+                bytes({0x48, 0xF7, 0xD8}); // neg rax
+                size_t done2 = jmp();
+                patch(zero, code.size());
+                bytes({0x31, 0xC0}); // xor eax, eax
+                patch(done2, code.size());
+            }
+            else
+            {
+                patch(zero, code.size());
+                bytes({0x31, 0xC0});
+            }
+            patch(done, code.size());
+            break;
+        }
+        case EXPR_POW:
+            if (misaligned)
+                sub_rsp(8);
+            bytes({0x48, 0x89, 0xC7, 0x48, 0x89, 0xCE}); // mov rdi, rax; mov rsi, rcx
+            load_const((int64_t)pow_fn);
+            bytes({0xFF, 0xD0}); // call rax
+            if (misaligned)
+                add_rsp(8);
+            break;
+        }
+    }
+    // jumps with a rel32 to fill in with patch(), return the position of it
+    size_t jcc(uint8_t cc)
+    {
+        bytes({0x0F, cc});
+        imm32(0);
+        return code.size() - 4;
+    }
+    size_t jmp()
+    {
+        bytes({0xE9});
+        imm32(0);
+        return code.size() - 4;
+    }
+    void patch(size_t at, size_t target)
+    {
+        int32_t rel = target - (at + 4);
+        memcpy(&code[at], &rel, 4);
+    }
+    void exit_with(int line) // mov eax, line, the caller jumps to the epilogue
+    {
+        bytes({0xB8});
+        imm32(line);
+    }
+    // Copies the code into executable memory
+    bool finish(JitRegion &region)
+    {
+        size_t page = sysconf(_SC_PAGESIZE);
+        region.size = (code.size() + page - 1) / page * page;
+        void *mem = mmap(nullptr, region.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return false;
+        memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, region.size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(mem, region.size);
+            return false;
+        }
+        region.code = mem;
+        return true;
+    }
+};
+
+// Everything load() produces. An interpreter owns one, or shares one with
+// other interpreters (sipli::Program), then nothing in it changes any more.
+struct CompiledProgram
+{
+    string source; // the text lines point into, when the program owns it
+    vector<SourceLine> lines;
+    map<int, string> labels;
+    unordered_map<string, int> label_index;
+    vector<Instruction> program;
+    vector<Instruction> actions; // IF actions, kept out of program so indices match lines
+    // variable names interned while compiling, slot numbers of vars and arrays
+    vector<string> var_names;
+    unordered_map<string, int> var_slots;
+    vector<string> compile_errors; // errors reported while compiling, a .siplc file repeats them
+    // string literals, and STR values of the runs while the program is not shared
+    StringPool strings;
+};
+
+class Interpreter
+{
+    class HelpEntry
+    {
+    public:
+        string name, desc;
+        HelpEntry(string name, string desc)
+        {
+            this->name = name;
+            this->desc = desc;
+        }
+    };
+    // the loaded program, the members below are its parts
+    shared_ptr<CompiledProgram> code = make_shared<CompiledProgram>();
+    bool shared_code = false; // code belongs to a sipli::Program, see attach()
+    vector<SourceLine> &lines = code->lines;
+    map<int, string> &labels = code->labels;
+    unordered_map<string, int> &label_index = code->label_index;
+    vector<Instruction> &program = code->program;
+    vector<Instruction> &actions = code->actions;
+    vector<string> &var_names = code->var_names;
+    unordered_map<string, int> &var_slots = code->var_slots;
+    vector<string> &compile_errors = code->compile_errors;
+    StringPool &strings = code->strings;
+    // variables live in dense slots, names are interned to slot numbers.
+    // Names first seen while running a shared program get slots after
+    // var_names, kept in local_names.
+    vector<AbstractValue> vars;
+    vector<SiplArray> arrays; // same slot numbers as vars, arrays are declared with ARR
+    vector<string> local_names;
+    unordered_map<string, int> local_slots;
+    // STR values of a shared program, strings has its literals. Values are
+    // only interned while the pools are small, longer ones are not.
+    StringPool local_strings;
+    static const size_t POOL_LIMIT = 16 << 20, POOLED_LENGTH = 64;
+    uint64_t pooled_values = 0, heap_values = 0; // for debug output
+    OutputWriter out;
+    OutputWriter err;
+    // totals over every run(), for --stats
+    uint64_t executed = 0;
+    uint64_t errors = 0;
+    int64_t load_ns = 0, run_ns = 0;
+    unique_ptr<Profiler> profiler; // only set with --profile
+    unique_ptr<TraceRing> tracer;  // only set with --trace
+    unique_ptr<Metrics> metrics;   // only set with --metrics
+    bool stopped = false;          // the last run ended on an error
+    // --jit: jumps to each line, and the region compiled at a line once it
+    // has been jumped to JIT_THRESHOLD times
+    bool jit = false;
+    static const uint32_t JIT_THRESHOLD = 64;
+    vector<uint32_t> jit_hits;
+    vector<unique_ptr<JitRegion>> jit_regions;
+    uint64_t jit_compiled = 0, jit_entries = 0;
+    Random rng;
+    istream *in = &cin; // INPT, nullptr: no input without input_source
+    unique_ptr<InputReader> stdin_reader; // replaces in when set, for -f
+    function<bool(string &)> input_source; // replaces both when set
+    string input_line; // the last line read through in or input_source
+    // sessions: INPT takes lines from inbox and suspends while it is empty
+    bool queued_input = false;
+    deque<string> inbox;
+    bool inbox_closed = false;
+    int ip = 0; // next line of a suspended run
+    bool debug_verbose;
+    bool legacy;
+    int opt_level = 1; // -O
+    bool compiling = false; // errors go to compile_errors too
+    deque<string> repl_source; // run_appended() input, lines point into it
+    // snapshots: the file SNAP writes, the program they belong to, and the
+    // state --resume starts from
+    string snapshot_path;
+    bool snapshot_on_exit = false;
+    uint64_t program_hash = 0;
+    string_view resume_state;
+    const vector<HelpEntry> helpData{
+        HelpEntry("PRNT [text]", "print text (supports $variables)"),
+        HelpEntry("VAR [INT|STR] [name] = [val]", "define a variable"),
+        HelpEntry("INPT [varname]", "read stdin into variable"),
+        HelpEntry("INPT [varname] : [label]", "read stdin into variable, jump to label at the end of the input"),
+        HelpEntry("GOTO [label]", "jump to label"),
+        HelpEntry(":label", "define a label"),
+        HelpEntry("IF var [operand] val : [action]", "run action if condition met (Supported operands: == != < > <= >= )"),
+        HelpEntry("RNG [max] [var] or RNG [min] [max] [var]", "writes a random value between [min] (default 0, inclusive) and [max] (exclusive!) into a variable, or into every element of an INT array"),
+        HelpEntry("ARR [INT|STR] [name] [size]", "define an array of [size] zeros or empty strings"),
+        HelpEntry("VAR [INT|STR] [name][index] = [val]", "set an array element, $name[index] reads one"),
+        HelpEntry("LEN [array] [var]", "write the length of an array into a variable"),
+        HelpEntry("FILL [array] [val]", "set every element of an array"),
+        HelpEntry("SUM|MIN|MAX [array] [var]", "write the sum, minimum or maximum of an INT array into a variable"),
+        HelpEntry("DMP", "dump program data (debug only)"),
+        HelpEntry("DMP [file] or SNAP [file]", "save all variables and arrays to a snapshot file, --resume continues after this line"),
+        HelpEntry("HLP", "show help message"),
+        HelpEntry("EXIT", "abort program execution"),
+        HelpEntry("_comment", "ignored line")};
+
+private:
+    static bool starts_with(const string &s, const string &prefix)
+    {
+        return s.find(prefix) == 0;
+    }
+    int64_t bounded_rand(int64_t min, int64_t max)
+    {
+        return rng.bounded(min, max);
+    }
+    static string_view trim_view(string_view s)
+    {
+        size_t start = s.find_first_not_of(" \t\n\r");
+        size_t end = s.find_last_not_of(" \t\n\r");
+        return (start == string_view::npos) ? string_view() : s.substr(start, end - start + 1);
+    }
+    static string trim(const string &s)
+    {
+        size_t start = s.find_first_not_of(" \t\n\r");
+        size_t end = s.find_last_not_of(" \t\n\r");
+        return (start == string::npos) ? "" : s.substr(start, end - start + 1);
+    }
+    vector<string> split(const string &str, char delimiter)
+    {
+        vector<string> result;
+        stringstream ss(str);
+        string item;
+        DEBUG_PRINT("Splitting str: " + str);
+        while (getline(ss, item, delimiter))
+        {
+            result.push_back(item);
+            DEBUG_PRINT("Got tok: " + item);
+        }
+        return result;
+    }
+    // split() without copies, for the compiler
+    static vector<string_view> split_view(string_view str, char delimiter)
+    {
+        vector<string_view> result;
+        size_t start = 0;
+        while (start < str.size())
+        {
+            size_t end = str.find(delimiter, start);
+            if (end == string_view::npos)
+                end = str.size();
+            result.push_back(str.substr(start, end - start));
+            start = end + 1;
+        }
+        return result;
+    }
+    void handle_echo(const string &text)
+    {
+        regex var_pattern(R"(\$(\w+))");
+        string result;
+        sregex_iterator it(text.begin(), text.end(), var_pattern);
+        sregex_iterator end;
+
+        size_t last_pos = 0;
+        while (it != end)
+        {
+            result += text.substr(last_pos, it->position() - last_pos);
+            string varname = (*it)[1];
+            const AbstractValue *var = find_var(varname);
+            result += var ? var->getAsString() : "$" + varname;
+            last_pos = it->position() + it->length();
+            ++it;
+        }
+        result += text.substr(last_pos);
+        out.write_line(result);
+    }
+    // use DEBUG_PRINT, it skips building the message when debug is off
+    void debug_print(const string &t)
+    {
+        out.write_line("[DEBUG] " + t);
+    }
+    void print_help()
+    {
+        int mnlen = 0;
+        for (int i = 0; i < helpData.size(); i++)
+        {
+            HelpEntry entry = helpData[i];
+            if (entry.name.size() > mnlen)
+                mnlen = entry.name.size();
+        }
+        out.write("SIPL Token list\n\n");
+        for (int i = 0; i < helpData.size(); i++)
+        {
+            HelpEntry entry = helpData[i];
+            out.write_line(entry.name + ((string) " " * (mnlen - entry.name.size() + 2)) + " - " + entry.desc);
+        }
+    }
+    void dump()
+    {
+        // the loops only feed DEBUG_PRINT, SIPLI_NO_DEBUG drops them too
+#ifndef SIPLI_NO_DEBUG
+        if (debug_verbose)
+        {
+            DEBUG_PRINT("PROGRAM DATA DUMP:");
+            DEBUG_PRINT("## LABELS:");
+            for (pair<int, string> label : labels)
+            {
+                DEBUG_PRINT("- " + label.second + " at line " + to_string(lines[label.first].line));
+            }
+            DEBUG_PRINT("## VARIABLES:");
+            vector<int> order;
+            for (int slot = 0; slot < vars.size(); slot++)
+            {
+                if (vars[slot].getType() != VOID)
+                    order.push_back(slot);
+            }
+            sort(order.begin(), order.end(), [this](int a, int b) { return var_name(a) < var_name(b); });
+            for (int slot : order)
+            {
+                DEBUG_PRINT("- " + var_name(slot) + " = " + vars[slot].getAsString());
+            }
+            DEBUG_PRINT("## ARRAYS:");
+            order.clear();
+            for (int slot = 0; slot < arrays.size(); slot++)
+            {
+                if (arrays[slot].type != VOID)
+                    order.push_back(slot);
+            }
+            sort(order.begin(), order.end(), [this](int a, int b) { return var_name(a) < var_name(b); });
+            for (int slot : order)
+            {
+                DEBUG_PRINT("- " + var_name(slot));
+                for (size_t e = 0; e < arrays[slot].size(); e++)
+                {
+                    DEBUG_PRINT("| - " + arrays[slot].getAsString(e));
+                }
+            }
+        }
+#endif
+        if (tracer)
+            print_trace("DMP");
+        out.write_line("P. S. If you see no output, you might have debug mode disabled.");
+    }
+    void error(const string &msg, const string &line = "")
+    {
+        string text = msg;
+        if (!line.empty())
+            text += " | Line: \"" + line + "\"";
+        if (compiling)
+            compile_errors.push_back(text);
+        report_error(text);
+    }
+    void report_error(const string &text)
+    {
+        // keep program output and errors in order when both go to the same place
+        out.flush();
+        errors++;
+        err.write_line("[ERROR] " + text);
+        err.flush();
+    }
+
+public:
+    Interpreter(bool debug = 0, bool legacy = 0, FlushPolicy flush = FLUSH_AUTO) : out(STDOUT_FILENO, flush), err(STDERR_FILENO, FLUSH_LINE)
+    {
+        this->debug_verbose = debug;
+        this->legacy = legacy;
+        rng.reseed(random_device()() ^ chrono::steady_clock::now().time_since_epoch().count());
+    }
+    // An interpreter that keeps its output in out_text and err_text and reads
+    // INPT from input, for running many of them at once
+    Interpreter(string &out_text, string &err_text, istream &input, bool debug = 0, bool legacy = 0) : out(out_text), err(err_text)
+    {
+        this->debug_verbose = debug;
+        this->legacy = legacy;
+        this->in = &input;
+        rng.reseed(random_device()() ^ chrono::steady_clock::now().time_since_epoch().count());
+    }
+    // An interpreter for the program in code, used by sipli::Program to
+    // compile and by sipli::Context to run. Output is dropped until
+    // set_output() and set_error() give it somewhere to go.
+    Interpreter(shared_ptr<CompiledProgram> code, bool shared) : code(move(code)), out(-1, FLUSH_FULL), err(-1, FLUSH_FULL)
+    {
+        this->debug_verbose = false;
+        this->legacy = false;
+        this->shared_code = shared;
+        // a library never reads the host's stdin, only set_input
+        this->in = nullptr;
+        rng.reseed(random_device()() ^ chrono::steady_clock::now().time_since_epoch().count());
+        if (shared)
+            reset_vars();
+    }
+#pragma region embedding
+    // Clears every variable and array of a shared program and makes it
+    // ready to run from the first line
+    void reset_vars()
+    {
+        vars = vector<AbstractValue>(var_names.size());
+        arrays = vector<SiplArray>(var_names.size());
+        local_names.clear();
+        local_slots.clear();
+        local_strings.clear();
+        jit_hits = vector<uint32_t>(program.size());
+        jit_regions = vector<unique_ptr<JitRegion>>(program.size());
+    }
+    // Runs a shared program with the current variables. Returns false on EXIT.
+    bool run_shared()
+    {
+        return run_loaded(true, chrono::steady_clock::now());
+    }
+    void set_output(function<void(string_view)> sink)
+    {
+        out.set_sink(move(sink));
+    }
+    void set_error(function<void(string_view)> sink)
+    {
+        err.set_sink(move(sink));
+    }
+    void set_input(function<bool(string &)> source)
+    {
+        input_source = move(source);
+    }
+    // INPT reads stdin in large blocks instead of through cin. Only for
+    // programs that own stdin, the REPL reads its statements from cin.
+    void read_stdin()
+    {
+        stdin_reader = make_unique<InputReader>(STDIN_FILENO);
+    }
+    void set_value(const string &name, const AbstractValue &value)
+    {
+        set_var(name, value);
+    }
+    void set_text(const string &name, string_view text)
+    {
+        set_var(name, make_str(text));
+    }
+    const AbstractValue *value_of(const string &name) const
+    {
+        return find_var(name);
+    }
+    bool was_stopped() const
+    {
+        return stopped;
+    }
+#pragma endregion embedding
+#pragma region cache
+    // Key of a .siplc file: the source, the interpreter version and the
+    // optimizer level, 8 bytes at a time
+    uint64_t source_hash(string_view source) const
+    {
+        uint64_t h = 0x9E3779B97F4A7C15ULL ^ source.size();
+        auto mix = [&h](uint64_t v) {
+            h = (h ^ v) * 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 32;
+        };
+        size_t i = 0;
+        for (; i + 8 <= source.size(); i += 8)
+        {
+            uint64_t word;
+            memcpy(&word, source.data() + i, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, source.data() + i, source.size() - i);
+        mix(tail);
+        for (char c : SIPL_VER + SIPLI_APPENDIX)
+            mix(c);
+        mix(opt_level);
+        return h == 0 ? 1 : h;
+    }
+    // Writes the compiled program (after compile_program) to path
+    bool save_cache(const string &path, uint64_t hash)
+    {
+        CacheWriter w;
+        for (const SourceLine &line : lines)
+            w.lines.push_back({w.str(line.text), line.line, 0, line.offset});
+        for (const string &name : var_names)
+            w.names.push_back(w.str(name));
+        for (auto &label : labels)
+            w.labels.push_back({label.first, w.str(label.second)});
+        for (const Instruction &ins : program)
+            w.program.push_back(w.instr(ins));
+        for (const Instruction &ins : actions)
+            w.actions.push_back(w.instr(ins));
+        for (const string &text : compile_errors)
+            w.diagnostics.push_back(w.str(text));
+        return w.write(path, hash, opt_level);
+    }
+    // Loads a .siplc file written by save_cache. hash 0 skips the check
+    // against the source. Returns false if the file is stale or broken.
+    bool load_cache(string_view data, uint64_t hash)
+    {
+        CacheReader r(data);
+        if (!r.valid() || (hash && r.header.source_hash != hash) || r.header.opt_level != opt_level)
+            return false;
+        DEBUG_PRINT("Running in debug mode");
+        lines = vector<SourceLine>();
+        labels = map<int,string>();
+        label_index = unordered_map<string, int>();
+        var_names = vector<string>();
+        var_slots = unordered_map<string, int>();
+        this->program = vector<Instruction>();
+        actions = vector<Instruction>();
+        strings.clear();
+        lines.reserve(r.count(CS_LINES));
+        for (size_t i = 0; i < r.count(CS_LINES); i++)
+        {
+            CacheLine line = r.at<CacheLine>(CS_LINES, i);
+            lines.push_back({r.str(line.text), line.line, line.offset});
+        }
+        for (size_t i = 0; i < r.count(CS_NAMES); i++)
+        {
+            string name(r.str(r.at<CacheStr>(CS_NAMES, i)));
+            var_slots[name] = var_names.size();
+            var_names.push_back(name);
+        }
+        vars = vector<AbstractValue>(var_names.size());
+        arrays = vector<SiplArray>(var_names.size());
+        for (size_t i = 0; i < r.count(CS_LABELS); i++)
+        {
+            CacheLabel label = r.at<CacheLabel>(CS_LABELS, i);
+            if (label.index < 0 || label.index >= lines.size())
+                return false;
+            labels[label.index] = string(r.str(label.name));
+            label_index[labels[label.index]] = label.index;
+        }
+        if (r.count(CS_PROGRAM) != lines.size())
+            return false;
+        this->program.reserve(lines.size());
+        for (size_t i = 0; i < r.count(CS_PROGRAM); i++)
+            this->program.push_back(r.instr(i, CS_PROGRAM));
+        for (size_t i = 0; i < r.count(CS_ACTIONS); i++)
+            actions.push_back(r.instr(i, CS_ACTIONS));
+        // everything used as an index at run time. A .siplc file holds the
+        // program before fuse_program, so fused opcodes are never valid.
+        auto slot_ok = [this](int slot) { return slot >= -1 && slot < (int)var_names.size(); };
+        auto expr_ok = [&](const vector<ExprTerm> &expr) {
+            // the depth eval_terms' stack reaches, compile_expr leaves one value
+            int depth = 0;
+            for (const ExprTerm &t : expr)
+            {
+                if (t.kind == TERM_CONST)
+                    depth++;
+                else if (t.kind == TERM_VAR || t.kind == TERM_NAME)
+                    depth += t.value >= 0 && t.value < (int64_t)var_names.size() ? 1 : EXPR_STACK_SIZE + 1;
+                else if (t.kind == TERM_OP)
+                    depth = t.value >= EXPR_ADD && t.value <= EXPR_POW && depth >= 2 ? depth - 1 : 0;
+                else if (t.kind == TERM_DROP)
+                    depth = t.value >= 1 && t.value < depth ? depth - t.value : 0;
+                else if (t.kind == TERM_ELEM)
+                    depth = t.value >= 0 && t.value < (int64_t)var_names.size() ? depth : 0;
+                else
+                    depth = 0;
+                if (depth < 1 || depth > EXPR_STACK_SIZE)
+                    return false;
+            }
+            return expr.empty() || depth == 1;
+        };
+        auto ins_ok = [&](const Instruction &ins, int max_action) {
+            bool slot = false, array = false, jump = false;
+            switch (ins.op)
+            {
+            case OP_VAR_INT:
+            case OP_VAR_STR:
+            case OP_INPT:
+            case OP_RNG:
+            case OP_IF:
+                slot = true;
+                break;
+            case OP_LEN:
+            case OP_SUM:
+            case OP_MIN:
+            case OP_MAX:
+                slot = array = true;
+                break;
+            case OP_ARR:
+                array = true;
+                if (ins.number != INTEGER && ins.number != STRING)
+                    return false;
+                break;
+            case OP_SET_INT:
+            case OP_SET_STR:
+            case OP_FILL:
+                array = true;
+                break;
+            case OP_GOTO:
+                jump = true;
+                break;
+            case OP_INC:
+            case OP_BRANCH:
+            case OP_INC_BRANCH:
+            case OP_PRNT_CONST:
+                return false;
+            default:
+                if (ins.op > OP_FALLBACK)
+                    return false;
+                break;
+            }
+            bool ok = slot_ok(ins.slot) && slot_ok(ins.array) && slot_ok(ins.index_slot) && (!slot || ins.slot != -1) &&
+                      (!array || ins.array != -1) && ins.target >= (jump ? 0 : -1) && ins.target < (int)lines.size() &&
+                      ins.cmp <= CMP_GE && (ins.op == OP_IF ? ins.action >= 0 && ins.action < max_action : ins.action == -1) &&
+                      expr_ok(ins.expr);
+            for (const PrintPiece &piece : ins.pieces)
+                ok = ok && slot_ok(piece.slot) && slot_ok(piece.index_slot) && piece.name_len <= piece.text.size() &&
+                     (!piece.element || piece.slot != -1);
+            return ok;
+        };
+        // an IF action's own action was compiled, and stored, before it
+        bool valid = r.ok;
+        for (const Instruction &ins : this->program)
+            valid = valid && ins_ok(ins, actions.size());
+        for (int k = 0; k < actions.size(); k++)
+            valid = valid && ins_ok(actions[k], k);
+        if (!valid)
+            return false;
+        program_hash = r.header.source_hash;
+        DEBUG_PRINT("Loaded " + to_string(lines.size()) + " lines from the compiled cache");
+        for (size_t i = 0; i < r.count(CS_DIAGNOSTICS); i++)
+            report_error(string(r.str(r.at<CacheStr>(CS_DIAGNOSTICS, i))));
+        return true;
+    }
+#pragma endregion cache
+#pragma region snapshot
+    // SNAP without a file writes to path, with on_exit the state is also
+    // saved when a run ends or is stopped by SIGINT or SIGTERM
+    void set_snapshot(const string &path, bool on_exit)
+    {
+        snapshot_path = path;
+        snapshot_on_exit = on_exit;
+    }
+    void set_program_hash(uint64_t hash)
+    {
+        program_hash = hash;
+    }
+    // the next run restores state, a mapped snapshot, and starts where it was taken
+    void resume_from(string_view state)
+    {
+        resume_state = state;
+    }
+    // Writes every variable and array and the line to continue at to path
+    bool write_snapshot(const string &path, int next_line)
+    {
+        SnapHeader header{};
+        memcpy(header.magic, SNAP_MAGIC, 8);
+        header.format = SNAP_FORMAT;
+        header.program_hash = program_hash;
+        header.ip = next_line;
+        header.var_count = vars.size();
+        header.vars_offset = sizeof(header);
+        header.blob_offset = sizeof(header) + vars.size() * sizeof(SnapVar);
+        string file(header.blob_offset, '\0');
+        string blob;
+        auto str = [&blob](string_view text) {
+            SnapStr ref{blob.size(), text.size()};
+            blob.append(text);
+            return ref;
+        };
+        for (size_t slot = 0; slot < vars.size(); slot++)
+        {
+            SnapVar rec{};
+            const AbstractValue &var = vars[slot];
+            const SiplArray &arr = arrays[slot];
+            rec.name = str(var_name(slot));
+            rec.type = var.getType();
+            if (rec.type == INTEGER)
+                rec.number = var.getAsInt();
+            else if (rec.type == STRING)
+                rec.text = str(var.getAsString());
+            rec.array_type = arr.type;
+            rec.array_size = arr.size();
+            if (arr.type == INTEGER)
+            {
+                blob.resize((blob.size() + 7) / 8 * 8, '\0');
+                rec.array_offset = blob.size();
+                blob.append((const char *)arr.numbers.data(), arr.numbers.size() * sizeof(int64_t));
+            }
+            else if (arr.type == STRING)
+            {
+                vector<SnapStr> refs;
+                refs.reserve(arr.strings.size());
+                for (const string &text : arr.strings)
+                    refs.push_back(str(text));
+                blob.resize((blob.size() + 7) / 8 * 8, '\0');
+                rec.array_offset = blob.size();
+                blob.append((const char *)refs.data(), refs.size() * sizeof(SnapStr));
+            }
+            memcpy(&file[header.vars_offset + slot * sizeof(SnapVar)], &rec, sizeof(rec));
+        }
+        header.blob_size = blob.size();
+        memcpy(&file[0], &header, sizeof(header));
+        file += blob;
+        return write_file(path, file);
+    }
+    // Replaces all variables and arrays with the ones in a snapshot of this
+    // program, first is set to the line to continue at
+    bool restore_snapshot(string_view data, int &first)
+    {
+        SnapHeader header;
+        if (!read_snapshot_header(data, header))
+        {
+            error("Not a snapshot of this SIPLI version");
+            return false;
+        }
+        int size = legacy ? lines.size() : program.size();
+        if (header.program_hash != program_hash || header.ip < 0 || header.ip > size || header.var_count < var_names.size())
+        {
+            error("The snapshot was taken of a different program");
+            return false;
+        }
+        const char *blob = data.data() + header.blob_offset;
+        bool ok = true;
+        auto str = [&](SnapStr ref) {
+            ok = ok && snapshot_range(header, ref.off, ref.len, 1);
+            return ok ? string(blob + ref.off, ref.len) : string();
+        };
+        vars.assign(vars.size(), AbstractValue());
+        arrays.assign(arrays.size(), SiplArray());
+        for (size_t slot = 0; slot < header.var_count && ok; slot++)
+        {
+            SnapVar rec;
+            memcpy(&rec, data.data() + header.vars_offset + slot * sizeof(SnapVar), sizeof(rec));
+            // names added at run time get the next slots again
+            if (slot >= vars.size() && intern(str(rec.name)) != slot)
+                ok = false;
+            if (!ok)
+                break;
+            if (rec.type == INTEGER)
+                vars[slot] = AbstractValue((int64_t)rec.number);
+            else if (rec.type == STRING)
+                vars[slot] = make_str(str(rec.text));
+            SiplArray &arr = arrays[slot];
+            if (rec.array_type == INTEGER && snapshot_range(header, rec.array_offset, rec.array_size, sizeof(int64_t)))
+            {
+                arr.type = INTEGER;
+                arr.numbers.resize(rec.array_size);
+                memcpy(arr.numbers.data(), blob + rec.array_offset, rec.array_size * sizeof(int64_t));
+            }
+            else if (rec.array_type == STRING && snapshot_range(header, rec.array_offset, rec.array_size, sizeof(SnapStr)))
+            {
+                arr.type = STRING;
+                arr.strings.resize(rec.array_size);
+                for (size_t e = 0; e < rec.array_size; e++)
+                {
+                    SnapStr ref;
+                    memcpy(&ref, blob + rec.array_offset + e * sizeof(SnapStr), sizeof(ref));
+                    arr.strings[e] = str(ref);
+                }
+            }
+            else if (rec.array_type != VOID)
+                ok = false;
+        }
+        if (!ok)
+        {
+            error("The snapshot is damaged");
+            return false;
+        }
+        first = header.ip;
+        DEBUG_PRINT("Resumed " + to_string(header.var_count) + " variables at line " + to_string(first + 1));
+        return true;
+    }
+    // SNAP and DMP file, the snapshot continues after line i
+    bool snapshot_line(const string &path, int i, const string &line)
+    {
+        if (path.empty())
+            error("SNAP needs a file name, or --snapshot", line);
+        else if (!write_snapshot(path, i + 1))
+            error("Could not write snapshot " + path, line);
+        else
+            return true;
+        return false;
+    }
+#pragma endregion snapshot
+    void set_opt_level(int level)
+    {
+        opt_level = level;
+    }
+    // --seed, makes RNG repeatable
+    void seed(uint64_t seed)
+    {
+        rng.reseed(seed);
+    }
+    // Splits the source into statements in one pass without copying it.
+    // Statements end at ';', except inside "quotes" (which end at a line break).
+    // Comments start with '_' and end at ';' or at the end of the line.
+    int addLines(string_view source){
+        int ret=lines.size();
+        const char *begin = source.data(), *p = begin, *end = begin + source.size();
+        int line = 1;
+        while (p < end)
+        {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+            {
+                if (*p == '\n')
+                    line++;
+                p++;
+            }
+            if (p == end)
+                break;
+            if (*p == ';')
+            {
+                p++;
+                continue;
+            }
+            if (*p == '_')
+            {
+                p = find_any(p, end, ';', '\n', '\n');
+                if (p < end && *p == ';')
+                    p++;
+                continue;
+            }
+            const char *start = p;
+            int start_line = line;
+            while ((p = find_any(p, end, ';', '"', '\n')) < end)
+            {
+                if (*p == '\n')
+                {
+                    line++;
+                }
+                else if (*p == '"')
+                {
+                    // a ; between quotes is text, but only if the quote
+                    // closes on the same line
+                    const char *close = find_any(p + 1, end, '"', '\n', '\n');
+                    if (close < end && *close == '"')
+                        p = close;
+                }
+                else
+                {
+                    break;
+                }
+                p++;
+            }
+            lines.push_back({trim_view(string_view(start, p - start)), start_line, (size_t)(start - begin)});
+            if (p < end)
+                p++;
+        }
+        return ret;
+    }
+    int find_label(const string &name){
+        DEBUG_PRINT("Checking label " + name);
+        auto it = label_index.find(name);
+        if (it != label_index.end())
+            return it->second;
+        DEBUG_PRINT("Label not found");
+        return -1;
+    }
+    // Returns the slot of a variable, creating an undefined one if needed
+    int intern(const string &name)
+    {
+        auto it = var_slots.find(name);
+        if (it != var_slots.end())
+            return it->second;
+        int slot = vars.size();
+        if (shared_code)
+        {
+            it = local_slots.find(name);
+            if (it != local_slots.end())
+                return it->second;
+            local_slots[name] = slot;
+            local_names.push_back(name);
+        }
+        else
+        {
+            var_slots[name] = slot;
+            var_names.push_back(name);
+        }
+        vars.push_back(AbstractValue());
+        arrays.push_back(SiplArray());
+        return slot;
+    }
+    // nullptr if the variable was never assigned
+    const AbstractValue *find_var(const string &name) const
+    {
+        auto it = var_slots.find(name);
+        int slot;
+        if (it != var_slots.end())
+            slot = it->second;
+        else
+        {
+            auto local = local_slots.find(name);
+            if (local == local_slots.end())
+                return nullptr;
+            slot = local->second;
+        }
+        return vars[slot].getType() == VOID ? nullptr : &vars[slot];
+    }
+    const string &var_name(int slot) const
+    {
+        return slot < var_names.size() ? var_names[slot] : local_names[slot - var_names.size()];
+    }
+    void set_var(const string &name, const AbstractValue &value)
+    {
+        vars[intern(name)] = value;
+    }
+    // A STR value for text, pooled while it is short and the pool has room.
+    // Texts already in a pool are always found.
+    AbstractValue make_str(string_view text)
+    {
+        StringPool &pool = shared_code ? local_strings : strings;
+        const PoolStr *str = strings.find(text);
+        if (!str && shared_code)
+            str = pool.find(text);
+        if (!str && text.size() <= POOLED_LENGTH && pool.bytes < POOL_LIMIT)
+            str = pool.add(text);
+        if (!str)
+        {
+            heap_values++;
+            return AbstractValue(string(text));
+        }
+        pooled_values++;
+        return AbstractValue(str);
+    }
+    // Points VAR STR values and IF ==/!= literals at their pooled copies
+    void intern_literals(int first = 0, int first_action = 0)
+    {
+        auto literal = [this](Instruction &ins) {
+            if (ins.op == OP_VAR_STR || ((ins.op == OP_IF || ins.op == OP_BRANCH) && (ins.cmp == CMP_EQ || ins.cmp == CMP_NE)))
+                ins.str = strings.add(ins.value);
+        };
+        for (int i = first; i < program.size(); i++)
+            literal(program[i]);
+        for (int i = first_action; i < actions.size(); i++)
+            literal(actions[i]);
+    }
+    // One line for INPT, false at the end of the input. line is valid
+    // until the next call.
+    bool read_input(string_view &line)
+    {
+        if (!metrics)
+            return read_line(line);
+        update_metrics();
+        Metrics::set(metrics->waiting, 1);
+        auto start = chrono::steady_clock::now();
+        bool ok = read_line(line);
+        Metrics::observe(metrics->input_wait, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        Metrics::set(metrics->waiting, 0);
+        return ok;
+    }
+    bool read_line(string_view &line)
+    {
+        if (stdin_reader && !input_source)
+            return stdin_reader->next(line);
+        if (input_source ? !input_source(input_line) : !in || !getline(*in, input_line))
+            return false;
+        line = input_line;
+        return true;
+    }
+    // Builds the label tables for the lines from first on. Returns false if
+    // a label is defined twice.
+    bool index_labels(int first = 0)
+    {
+        bool ok = true;
+        for (int i = first; i < lines.size(); ++i)
+        {
+            string_view line = lines[i].text;
+            if (!line.empty() && line[0] == ':')
+            {
+                string label(trim_view(line.substr(1)));
+                DEBUG_PRINT("Found label " + label + " at line " + to_string(lines[i].line));
+                auto res = label_index.insert({label, i});
+                if (!res.second)
+                {
+                    error("Duplicate label: " + label + " (first defined at line " + to_string(lines[res.first->second].line) + ")", string(line));
+                    ok = false;
+                    continue;
+                }
+                labels[i] = label;
+            }
+        }
+        return ok;
+    }
+    // Points every GOTO at its label. Unknown labels are reported here once
+    // and the GOTO is dropped, like the runtime lookup used to do.
+    void link_program(int first = 0, int first_action = 0)
+    {
+        for (int i = first; i < program.size(); i++)
+            link_goto(program[i]);
+        for (int i = first_action; i < actions.size(); i++)
+            link_goto(actions[i]);
+    }
+    void link_goto(Instruction &ins)
+    {
+        if (ins.op == OP_INPT && !ins.value.empty())
+        {
+            // like GOTO, but a missing label only fails at the end of the input
+            ins.target = find_label(ins.value);
+            if (ins.target == -1)
+                error("Label not found: " + ins.value, ins.text);
+            return;
+        }
+        if (ins.op != OP_GOTO)
+            return;
+        ins.target = find_label(ins.name);
+        if (ins.target == -1)
+        {
+            error("Label not found: " + ins.name, ins.text);
+            ins.op = OP_NOP;
+        }
+    }
+    // Replaces common line shapes with superinstructions. The fused
+    // instruction stays at the index of its first line and skips the lines
+    // it covers, so program[i] still belongs to lines[i] for labels, errors
+    // and --trace, and the covered lines are kept for anything jumping there.
+    void fuse_program(int first = 0)
+    {
+        int fused = 0;
+        for (int i = first; i < program.size(); i++)
+        {
+            Instruction &ins = program[i];
+            if (ins.op == OP_IF && actions[ins.action].op == OP_GOTO)
+            {
+                ins.op = OP_BRANCH;
+                ins.target = actions[ins.action].target;
+                fused++;
+            }
+            else if (ins.op == OP_VAR_INT && ins.expr.size() == 3 && ins.expr[2].kind == TERM_OP)
+            {
+                const ExprTerm &a = ins.expr[0], &b = ins.expr[1];
+                int64_t op = ins.expr[2].value;
+                bool var_first = (a.kind == TERM_VAR || a.kind == TERM_NAME) && a.value == ins.slot && b.kind == TERM_CONST;
+                bool var_second = (b.kind == TERM_VAR || b.kind == TERM_NAME) && b.value == ins.slot && a.kind == TERM_CONST;
+                if ((var_first && (op == EXPR_ADD || op == EXPR_SUB)) || (var_second && op == EXPR_ADD))
+                {
+                    ins.op = OP_INC;
+                    ins.delta = var_first ? (op == EXPR_ADD ? b.value : -(uint64_t)b.value) : a.value;
+                    fused++;
+                }
+            }
+            else if (ins.op == OP_PRNT &&
+                     all_of(ins.pieces.begin(), ins.pieces.end(), [](const PrintPiece &p) { return p.slot == -1; }))
+            {
+                ins.op = OP_PRNT_CONST;
+                ins.value.clear();
+                for (const PrintPiece &piece : ins.pieces)
+                    ins.value += piece.text;
+                fused++;
+            }
+        }
+        // the IF after an increment can only be reached from it, labels are lines of their own
+        for (int i = max(first - 1, 0); i + 1 < program.size(); i++)
+        {
+            if (program[i].op == OP_INC && program[i + 1].op == OP_BRANCH)
+            {
+                program[i].op = OP_INC_BRANCH;
+                program[i].target = program[i + 1].target;
+                fused++;
+            }
+        }
+        DEBUG_PRINT("Fused " + to_string(fused) + " instructions");
+    }
+#pragma region optimizer
+    // -O1 threads jumps and drops unreachable lines, -O2 also propagates
+    // constants and drops dead stores. Lines are turned into OP_NOP instead of
+    // being removed, so program[i] still belongs to lines[i].
+    void optimize()
+    {
+        if (opt_level < 1)
+            return;
+        thread_jumps();
+        remove_unreachable();
+        if (opt_level < 2)
+            return;
+        propagate_constants();
+        remove_dead_stores();
+    }
+    void remove_line(Instruction &ins, [[maybe_unused]] const string &why)
+    {
+        DEBUG_PRINT("Optimizer: removed " + why + ": " + ins.text);
+        string text = ins.text;
+        ins = Instruction();
+        ins.text = text;
+    }
+    // GOTO a; ... :a; GOTO b  ->  GOTO b
+    void thread_jumps()
+    {
+        int threaded = 0;
+        auto thread_goto = [&](Instruction &ins) {
+            if (ins.op != OP_GOTO)
+                return;
+            int target = ins.target;
+            for (int hops = 0; hops < program.size(); hops++)
+            {
+                int next = target;
+                while (next < program.size() && program[next].op == OP_NOP)
+                    next++;
+                if (next == program.size() || program[next].op != OP_GOTO || program[next].target == target)
+                    break;
+                target = program[next].target;
+            }
+            if (target != ins.target)
+            {
+                DEBUG_PRINT("Optimizer: threaded " + ins.text + " to line " + to_string(target + 1));
+                ins.target = target;
+                threaded++;
+            }
+        };
+        for (Instruction &ins : program)
+            thread_goto(ins);
+        for (Instruction &ins : actions)
+            thread_goto(ins);
+    }
+    void remove_unreachable()
+    {
+        vector<bool> reachable(program.size());
+        vector<int> work{0};
+        bool all_labels = false; // a legacy line can GOTO any label
+        while (!work.empty())
+        {
+            int i = work.back();
+            work.pop_back();
+            if (i >= program.size() || reachable[i])
+                continue;
+            reachable[i] = true;
+            const Instruction &ins = program[i];
+            const Instruction *action = ins.op == OP_IF ? &actions[ins.action] : nullptr;
+            if (!all_labels && (ins.op == OP_FALLBACK || (action && action->op == OP_FALLBACK)))
+            {
+                all_labels = true;
+                for (auto &label : labels)
+                    work.push_back(label.first);
+            }
+            if (ins.op == OP_GOTO)
+                work.push_back(ins.target);
+            else if (ins.op != OP_EXIT && ins.op != OP_ERROR)
+                work.push_back(i + 1);
+            if (action && action->op == OP_GOTO)
+                work.push_back(action->target);
+            for (const Instruction *jump : {&ins, action})
+            {
+                if (jump && jump->op == OP_INPT && jump->target != -1)
+                    work.push_back(jump->target);
+            }
+        }
+        for (int i = 0; i < program.size(); i++)
+        {
+            if (!reachable[i] && program[i].op != OP_NOP)
+                remove_line(program[i], "unreachable line " + to_string(i + 1));
+        }
+    }
+    // Folds constant operations, like compile_expr does while parsing
+    static void fold_terms(vector<ExprTerm> &expr)
+    {
+        vector<ExprTerm> out;
+        for (const ExprTerm &t : expr)
+        {
+            size_t n = out.size();
+            if (t.kind == TERM_OP && n >= 2 && out[n - 1].kind == TERM_CONST && out[n - 2].kind == TERM_CONST)
+            {
+                out[n - 2].value = apply_op(t.value, out[n - 2].value, out[n - 1].value);
+                out.pop_back();
+            }
+            else if (t.kind == TERM_DROP && n >= t.value &&
+                     all_of(out.end() - t.value, out.end(), [](const ExprTerm &c) { return c.kind == TERM_CONST; }))
+            {
+                out.resize(n - t.value);
+            }
+            else
+            {
+                out.push_back(t);
+            }
+        }
+        expr = out;
+    }
+    // Within straight-line code, replaces reads of variables that were just
+    // set to a constant integer. The assignments stay, DMP and later lines
+    // still see them.
+    void propagate_constants()
+    {
+        unordered_map<int, int64_t> known;
+        int replaced = 0;
+        auto substitute = [&](vector<ExprTerm> &expr) {
+            bool changed = false;
+            for (ExprTerm &t : expr)
+            {
+                auto it = (t.kind == TERM_VAR || t.kind == TERM_NAME) ? known.find(t.value) : known.end();
+                if (it != known.end())
+                {
+                    t = {TERM_CONST, it->second};
+                    changed = true;
+                }
+            }
+            if (changed)
+            {
+                fold_terms(expr);
+                replaced++;
+            }
+        };
+        auto written = [&](const Instruction &ins) {
+            switch (ins.op)
+            {
+            case OP_VAR_INT:
+                if (ins.expr.size() == 1 && ins.expr[0].kind == TERM_CONST)
+                    known[ins.slot] = ins.expr[0].value;
+                else
+                    known.erase(ins.slot);
+                break;
+            case OP_VAR_STR:
+            case OP_INPT:
+            case OP_RNG:
+            case OP_LEN:
+            case OP_SUM:
+            case OP_MIN:
+            case OP_MAX:
+                known.erase(ins.slot);
+                break;
+            case OP_FALLBACK:
+                known.clear();
+                break;
+            default:
+                break;
+            }
+        };
+        for (int i = 0; i < program.size(); i++)
+        {
+            Instruction &ins = program[i];
+            if (labels.count(i))
+                known.clear();
+            switch (ins.op)
+            {
+            case OP_VAR_INT:
+            case OP_SET_INT:
+            case OP_ARR:
+            case OP_FILL:
+                substitute(ins.expr);
+                break;
+            case OP_PRNT:
+            {
+                vector<PrintPiece> pieces;
+                for (const PrintPiece &piece : ins.pieces)
+                {
+                    auto it = piece.slot != -1 && !piece.element ? known.find(piece.slot) : known.end();
+                    if (it == known.end())
+                    {
+                        pieces.push_back(piece);
+                        continue;
+                    }
+                    if (!pieces.empty() && pieces.back().slot == -1)
+                        pieces.back().text += to_string(it->second);
+                    else
+                        pieces.push_back({to_string(it->second), -1});
+                    replaced++;
+                }
+                ins.pieces = pieces;
+                break;
+            }
+            case OP_IF:
+            {
+                Instruction &action = actions[ins.action];
+                if (action.op == OP_VAR_INT)
+                    substitute(action.expr);
+                auto it = known.find(ins.slot);
+                if (it != known.end() && (action.op == OP_GOTO || action.op == OP_NOP))
+                {
+                    // the outcome is known, a GOTO action can not fail
+                    replaced++;
+                    if (test_condition(ins, AbstractValue(it->second)) && action.op == OP_GOTO)
+                    {
+                        DEBUG_PRINT("Optimizer: condition always true: " + ins.text);
+                        string text = ins.text;
+                        ins = action;
+                        ins.text = text;
+                    }
+                    else
+                    {
+                        remove_line(ins, "condition that is never true");
+                    }
+                    break;
+                }
+                // the action may or may not run
+                if (action.op == OP_FALLBACK)
+                    known.clear();
+                else if (action.slot != -1)
+                    known.erase(action.slot);
+                break;
+            }
+            default:
+                break;
+            }
+            written(ins);
+            if (ins.op == OP_GOTO || ins.op == OP_EXIT || ins.op == OP_ERROR)
+                known.clear();
+        }
+        if (replaced)
+            DEBUG_PRINT("Optimizer: propagated constants into " + to_string(replaced) + " places");
+    }
+    // Whether ins may look at the variable in slot. Anything unknown does,
+    // and so does anything that can stop the program: the variable is still
+    // visible after the error (DMP, --snapshot-on-exit, Context::get_int).
+    bool reads(const Instruction &ins, int slot)
+    {
+        // anything that can jump (INPT name : label at the end of the input,
+        // also as an IF action) leaves the stores live on the other path
+        if (ins.target != -1)
+            return true;
+        switch (ins.op)
+        {
+        case OP_NOP:
+        case OP_HLP:
+        case OP_VAR_STR:
+        case OP_RNG:
+            return false;
+        case OP_VAR_INT:
+            // constant expressions can not fail, variables may be undefined
+            return any_of(ins.expr.begin(), ins.expr.end(), [](const ExprTerm &t) {
+                return t.kind == TERM_VAR || t.kind == TERM_NAME || t.kind == TERM_ELEM;
+            });
+        case OP_PRNT:
+            for (const PrintPiece &piece : ins.pieces)
+            {
+                if (piece.slot == slot || piece.element)
+                    return true;
+            }
+            return false;
+        case OP_IF:
+            // only == and != never fail
+            return ins.slot == slot || (ins.cmp != CMP_EQ && ins.cmp != CMP_NE) || reads(actions[ins.action], slot);
+        default:
+            // INPT without a label, arrays and anything not compiled
+            return true;
+        }
+    }
+    // VAR x = constant; ...; VAR x = constant with no read of x in between
+    void remove_dead_stores()
+    {
+        auto constant_store = [](const Instruction &ins) {
+            return ins.op == OP_VAR_STR ||
+                   (ins.op == OP_VAR_INT && all_of(ins.expr.begin(), ins.expr.end(), [](const ExprTerm &t) {
+                        return t.kind == TERM_CONST || t.kind == TERM_OP || t.kind == TERM_DROP;
+                    }));
+        };
+        for (int i = 0; i < program.size(); i++)
+        {
+            if (!constant_store(program[i]))
+                continue;
+            int slot = program[i].slot;
+            for (int j = i + 1; j < program.size() && !labels.count(j); j++)
+            {
+                const Instruction &next = program[j];
+                if (reads(next, slot))
+                    break;
+                if (constant_store(next) && next.slot == slot)
+                {
+                    remove_line(program[i], "dead store on line " + to_string(i + 1));
+                    break;
+                }
+            }
+        }
+    }
+#pragma endregion optimizer
+    // The increment of OP_INC, falls back to the expression if the
+    // variable is not an integer so the errors stay the same
+    void increment(const Instruction &ins)
+    {
+        AbstractValue &var = vars[ins.slot];
+        if (var.getType() == INTEGER)
+            var = (int64_t)((uint64_t)var.getAsInt() + (uint64_t)ins.delta);
+        else
+            var = eval_terms(ins.expr);
+    }
+    void debug_line([[maybe_unused]] int i)
+    {
+        DEBUG_PRINT("L " + to_string(i + 1) + " / " + to_string(lines.size()) + " : " + program[i].text);
+    }
+    string preprocess_expr(const string& expr) {
+        string result;
+        for (size_t i = 0; i < expr.size(); ++i) {
+            if (expr[i] == '$') {
+                i++;
+                string varname;
+                while (i < expr.size() && (isalnum(expr[i]) || expr[i] == '_')) {
+                    varname += expr[i];
+                    ++i;
+                }
+                --i;
+                if (const AbstractValue *var = find_var(varname)) {
+                    result += var->getAsString();
+                }else {
+                    error("Undefined variable: " + varname);
+                }
+            }else {
+                result += expr[i];
+            }
+        }
+        return result;
+    }
+
+    string eval_expr(const string &s)
+    {
+        if (s.empty())
+            return "";
+        string replaced = preprocess_expr(s);
+        vector<string> toks = split(replaced, ' ');
+        vector<int64_t> stack;
+        for (int ti = 0; ti < toks.size(); ti++)
+        {
+            string t = toks[ti];
+            if (isdigit(t[0]) || (t[0] == '-' && t.size() > 1))
+            {
+                stack.push_back(stoll(t));
+            }
+            else if (t[0] == '$')
+            {
+                if (t[1] == '(')
+                {
+                    DEBUG_PRINT("Found possible expression definition;");
+                    int sti = ti;
+                    string expr = "";
+                    bool found = false;
+                    while (!found)
+                    {
+                        string tok = toks[sti];
+                        for (int ci = 0; ci < tok.size(); ci++)
+                        {
+                            char c = tok[ci];
+                            if (sti == ti && ci <= 1)
+                                continue;
+                            if (c == ')')
+                            {
+                                found = 1;
+                                break;
+                            }
+                            else if (c == ';')
+                            {
+                                found = 0;
+                                break;
+                            }
+                            else
+                            {
+                                expr += c;
+                            }
+                        }
+                        expr += " ";
+                        sti++;
+                    }
+                    if (!found)
+                    {
+                        error("Unmatched () in expr " + s);
+                        return "";
+                    }
+                    else
+                    {
+                        ti = sti - 1;
+                        return eval_expr(expr);
+                    }
+                }
+                else
+                {
+                    string varname = t.substr(1);
+                    if (const AbstractValue *var = find_var(varname))
+                    {
+                        stack.push_back(var->getAsInt());
+                    }
+                    else
+                    {
+                        throw runtime_error("Undefined variable: " + varname);
+                    }
+                }
+            }
+            else if (const AbstractValue *var = find_var(t))
+            {
+                stack.push_back(var->getAsInt());
+            }
+            else if (find(EXPR_OPS.begin(), EXPR_OPS.end(), t) != EXPR_OPS.end())
+            {
+                if (stack.size() < 2)
+                    throw runtime_error("Not enough operands for: " + t);
+                int64_t b = stack.back();
+                stack.pop_back();
+                int64_t a = stack.back();
+                stack.pop_back();
+                // the same arithmetic as the compiled engine, / 0 and % 0 give 0
+                stack.push_back(apply_op(find(EXPR_OPS.begin(), EXPR_OPS.end(), t) - EXPR_OPS.begin(), a, b));
+            }
+            else
+            {
+                throw runtime_error("Unsupported token: " + t);
+            }
+        }
+
+        return stack.empty() ? "" : to_string(stack[0]);
+    }
+    // returns false if the condition is malformed, throws if it can not be compared
+    bool eval_condition(const string &condition, bool &cond_met)
+    {
+        // TODO: remove and replace with expression handler
+        regex comp_regex(R"((\w+)\s*(==|!=|<|>|<=|>=)\s*(\"?.+?\"?))");
+        smatch match;
+        if (!regex_match(condition, match, comp_regex))
+            return false;
+        DEBUG_PRINT("IF REGEX DUMP");
+        for (int i = 0; i < match.length(); i++)
+        {
+            string data = match[i];
+            DEBUG_PRINT("[" + to_string(i) + "] " + data);
+        }
+        DEBUG_PRINT("END IF REGEX DUMP");
+        string var = match[1];
+        string op = match[2];
+        string val = match[3];
+
+        const AbstractValue *var_ptr = find_var(var);
+        string var_val = var_ptr ? var_ptr->getAsString() : "";
+        cond_met = false;
+
+        if (val.front() == '"' && val.back() == '"')
+            val = val.substr(1, val.size() - 2);
+
+        if (op == "==")
+            cond_met = (var_val == val);
+        else if (op == "!=")
+            cond_met = (var_val != val);
+        else
+        {
+            int64_t lhs = stoll(var_val);
+            int64_t rhs = stoll(val);
+            if (op == "<")
+                cond_met = lhs < rhs;
+            else if (op == ">")
+                cond_met = lhs > rhs;
+            else if (op == "<=")
+                cond_met = lhs <= rhs;
+            else if (op == ">=")
+                cond_met = lhs >= rhs;
+        }
+        return true;
+    }
+    int exec_line(string line, int &i)
+    {
+        try
+        {
+            if (line.empty() || line[0] == ':' || line[0] == '_')
+            {
+                DEBUG_PRINT("Line empty");
+                return 1;
+            }
+            vector<string> arg = split(line, ' ');
+
+            if (arg[0] == "PRNT")
+            {
+                handle_echo(trim(line.substr(4)));
+            }
+            else if (arg[0] == "VAR")
+            {
+                if (arg.size() < 5 || arg[3] != "="){
+                    error("Invalid VAR syntax", line);
+                }
+                string type = arg[1];
+                string name = arg[2];
+                string val = trim(line.substr(line.find('=') + 1));
 
+                if (type == "INT"){
+                    string evaluated = eval_expr(val);
+                    set_var(name, evaluated);
+                }
+                else if (type == "STR"){
+                    if (val.front() == '"' && val.back() == '"')
+                    val = val.substr(1, val.size() - 2);
+                    set_var(name, val);
+                }
+                else{
+                    error("Invalid type", line);
+                    return 0;
+                }
+            }
+            else if (arg[0] == "GOTO")
+            {
+                string label = arg[1];
+                int labelpos = find_label(label);
+                if(labelpos==-1){
+                    error("Label not found: " + label, line);
+                }
+                else{
+                    DEBUG_PRINT("Label found at line " + to_string(i + 1) + ", jumping");
+                    i = labelpos - 1;
+                }
+            }
+            else if (arg[0] == "IF")
+            {
+                string rest = trim(line.substr(2));
+                size_t colon = rest.find(':');
+                if (colon == string::npos)
+                {
+                    error("Invalid IF syntax", line);
+                }
+                string condition = trim(rest.substr(0, colon));
+                string action = trim(rest.substr(colon + 1));
+                bool cond_met = false;
+                if (eval_condition(condition, cond_met))
+                {
+                    if (cond_met)
+                    {
+                        exec_line(action, i);
+                    }
+                }
+                else
+                {
+                    error("Malformed condition in IF", line);
+                    return 0;
+                }
+            }
+            else if (arg[0] == "INPT")
+            {
+                string rest = line.substr(4);
+                size_t colon = rest.find(':');
+                string varname = trim(rest.substr(0, colon));
+                string label = colon == string::npos ? "" : trim(rest.substr(colon + 1));
+                if (varname.empty())
+                {
+                    error("Missing variable name for INPT", line);
+                    return 0;
+                }
+                string_view value;
+                out.flush();
+                if (read_input(value))
+                {
+                    set_var(varname, make_str(trim_view(value)));
+                }
+                else if (label.empty())
+                {
+                    error("Failed to read input", line);
+                    return 0;
+                }
+                else
+                {
+                    // INPT name : label jumps at the end of the input
+                    int labelpos = find_label(label);
+                    if (labelpos == -1)
+                    {
+                        error("Label not found: " + label, line);
+                        return 0;
+                    }
+                    DEBUG_PRINT("End of input, jumping to line " + to_string(labelpos + 1));
+                    i = labelpos - 1;
+                }
+            }
+            else if (arg[0] == "HLP")
+            {
+                print_help();
+            }
+            else if (arg[0] == "EXIT")
+            {
+                DEBUG_PRINT("Exiting.");
+                out.flush();
+                i = lines.size();
+                return -1;
+            }
+            else if (arg[0] == "DMP")
+            {
+                string path = trim(line.substr(3));
+                if (path.empty())
+                    dump();
+                else if (!snapshot_line(path, i, line))
+                    return 0;
+            }
+            else if (arg[0] == "SNAP")
+            {
+                string path = trim(line.substr(4));
+                if (!snapshot_line(path.empty() ? snapshot_path : path, i, line))
+                    return 0;
+            }
+            else if (arg[0] == "RNG")
+            {
+                int min_value = 0;
+                int max_value = 0;
+                string var_name = "";
+                bool failed = false;
+                if (arg.size() == 3)
+                {
+                    max_value = stoi(arg[1]);
+                    var_name = arg[2];
+                }
+                else if (arg.size() == 4)
+                {
+                    min_value = stoi(arg[1]);
+                    max_value = stoi(arg[2]);
+                    var_name = arg[3];
+                }
+                else
+                {
+                    error("Not enough or too many arguments for RNG");
+                    failed = true;
+                }
+                if (max_value <= 0)
+                {
+                    error("Maximum value for RNG should not be less than or equal to zero.");
+                    failed = true;
+                }
+                if(min_value >= max_value){
+                    error("The minimum value for RNG could not be larger than the maximum value.");
+                }
+                if (!failed)
+                {
+                    set_var(var_name, (int64_t)bounded_rand(min_value, max_value));
+                }
+            }
+            else
+            {
+                out.write_line("Unknown command: " + line);
+                return 0;
+            }
+        }
+        catch (exception &e)
+        {
+            error(string("Exception: ") + e.what(), line);
+            return 0;
+        }
+        return 1;
+    }
+    // Splits "name[index]"
+    static bool split_element(string_view t, string &name, string &index)
+    {
+        size_t open = t.find('[');
+        if (open == string_view::npos || open == 0 || t.back() != ']' || t.size() - open < 3)
+            return false;
+        name = string(t.substr(0, open));
+        index = string(t.substr(open + 1, t.size() - open - 2));
+        return true;
+    }
+    static bool is_word(const string &s)
+    {
+        return !s.empty() && all_of(s.begin(), s.end(), is_word_char);
+    }
+    // An array index is a non-negative number, $name or name
+    bool compile_index(const string &index, int &index_slot, int64_t &value)
+    {
+        if (!index.empty() && all_of(index.begin(), index.end(), ::isdigit))
+        {
+            value = stoll(index);
+            index_slot = -1;
+            return true;
+        }
+        string name = !index.empty() && index[0] == '$' ? index.substr(1) : index;
+        if (!is_word(name))
+            return false;
+        index_slot = intern(name);
+        return true;
+    }
+    // The declared array in slot, or throws if index is out of its range
+    SiplArray &array_at(int slot, int64_t index)
+    {
+        SiplArray &arr = arrays[slot];
+        if (arr.type == VOID)
+            throw runtime_error("Undefined array: " + var_name(slot));
+        if (index < 0 || index >= (int64_t)arr.size())
+            throw runtime_error("Index " + to_string(index) + " out of range for " + var_name(slot) + " (size " + to_string(arr.size()) + ")");
+        return arr;
+    }
+    int64_t index_of(int index_slot, int64_t index)
+    {
+        if (index_slot == -1)
+            return index;
+        if (vars[index_slot].getType() == VOID)
+            throw runtime_error("Undefined variable: " + var_name(index_slot));
+        return vars[index_slot].getAsInt();
+    }
+    // The array an instruction works on as a whole
+    SiplArray &declared_array(int slot)
+    {
+        if (arrays[slot].type == VOID)
+            throw runtime_error("Undefined array: " + var_name(slot));
+        return arrays[slot];
+    }
+    SiplArray &int_array(int slot)
+    {
+        SiplArray &arr = declared_array(slot);
+        if (arr.type != INTEGER)
+            throw runtime_error(var_name(slot) + " is not an INT array");
+        return arr;
+    }
+    // Compiles a postfix expression. Constant subexpressions are folded and
+    // $( ... ) groups push the first value their expression leaves, like
+    // eval_expr does for the whole expression. Returns false for anything that
+    // should be left to eval_expr, errors that eval_expr can not produce are
+    // returned in err.
+    bool compile_expr(const string &s, vector<ExprTerm> &out, string &err)
+    {
+        const vector<string> &ops = EXPR_OPS;
+        int depth = 0, max_depth = 0;
+        vector<int> groups; // depth at each open $(
+        // number of constants on top of the stack, they can be folded
+        auto trailing_consts = [&out]() {
+            int n = 0;
+            for (auto it = out.rbegin(); it != out.rend() && it->kind == TERM_CONST; ++it)
+                n++;
+            return n;
+        };
+        for (string_view tok : split_view(s, ' '))
+        {
+            string t(tok);
+            if (t.empty())
+                return false;
+            int opens = 0, closes = 0;
+            while (t.size() >= 2 && t[0] == '$' && t[1] == '(')
+            {
+                t = t.substr(2);
+                opens++;
+            }
+            while (!t.empty() && t.back() == ')')
+            {
+                t.pop_back();
+                closes++;
+            }
+            for (int g = 0; g < opens; g++)
+                groups.push_back(depth);
+            string elem_name, elem_index;
+            if (t.size() > 1 && t[0] == '$' && split_element(string_view(t).substr(1), elem_name, elem_index))
+            {
+                int index_slot;
+                int64_t index;
+                if (!is_word(elem_name) || !compile_index(elem_index, index_slot, index))
+                    return false;
+                if (index_slot == -1)
+                    out.push_back({TERM_CONST, index});
+                else
+                    out.push_back({elem_index[0] == '$' ? TERM_VAR : TERM_NAME, index_slot});
+                out.push_back({TERM_ELEM, intern(elem_name)});
+                depth++;
+            }
+            else if (!t.empty())
+            {
+                if (t.find('$', 1) != string::npos)
+                    return false;
+                auto op = find(ops.begin(), ops.end(), t);
+                if (t[0] == '$')
+                {
+                    string name = t.substr(1);
+                    if (name.empty())
+                        return false;
+                    for (char c : name)
+                    {
+                        if (!isalnum(c) && c != '_')
+                            return false;
+                    }
+                    out.push_back({TERM_VAR, intern(name)});
+                    depth++;
+                }
+                else if (isdigit(t[0]) || (t[0] == '-' && t.size() > 1))
+                {
+                    out.push_back({TERM_CONST, stoll(t)});
+                    depth++;
+                }
+                else if (op != ops.end())
+                {
+                    if (depth - (groups.empty() ? 0 : groups.back()) < 2)
+                        return false;
+                    if (trailing_consts() >= 2)
+                    {
+                        int64_t b = out.back().value;
+                        out.pop_back();
+                        out.back().value = apply_op(op - ops.begin(), out.back().value, b);
+                    }
+                    else
+                    {
+                        out.push_back({TERM_OP, op - ops.begin()});
+                    }
+                    depth--;
+                }
+                else
+                {
+                    out.push_back({TERM_NAME, intern(t)});
+                    depth++;
+                }
+            }
+            for (int g = 0; g < closes; g++)
+            {
+                if (groups.empty())
+                {
+                    err = "Unmatched () in expr " + s;
+                    return false;
+                }
+                int inner = depth - groups.back();
+                groups.pop_back();
+                if (inner < 1)
+                {
+                    err = "Empty () in expr " + s;
+                    return false;
+                }
+                if (inner > 1)
+                {
+                    if (trailing_consts() >= inner - 1)
+                        out.resize(out.size() - (inner - 1));
+                    else
+                        out.push_back({TERM_DROP, inner - 1});
+                }
+                depth -= inner - 1;
+            }
+            max_depth = max(max_depth, depth);
+        }
+        if (!groups.empty())
+        {
+            err = "Unmatched () in expr " + s;
+            return false;
+        }
+        // eval_terms returns the first value, the rest are dropped so every
+        // expression leaves exactly one (load_cache checks that)
+        if (depth > 1)
+        {
+            if (trailing_consts() >= depth - 1)
+                out.resize(out.size() - (depth - 1));
+            else
+                out.push_back({TERM_DROP, depth - 1});
+        }
+        return max_depth <= EXPR_STACK_SIZE;
+    }
+    static int64_t apply_op(int op, int64_t a, int64_t b)
+    {
+        switch (op)
+        {
+        // wrapping, like the --jit code
+        case EXPR_ADD:
+            return (uint64_t)a + (uint64_t)b;
+        case EXPR_SUB:
+            return (uint64_t)a - (uint64_t)b;
+        case EXPR_MUL:
+            return (uint64_t)a * (uint64_t)b;
+        case EXPR_DIV:
+            return b == 0 ? 0 : b == -1 ? 0 - (uint64_t)a : a / b;
+        case EXPR_MOD:
+            return b == 0 || b == -1 ? 0 : a % b;
+        case EXPR_POW:
+            return (int64_t)pow(a, b);
+        }
+        return 0;
+    }
+    static int64_t jit_pow(int64_t a, int64_t b)
+    {
+        return apply_op(EXPR_POW, a, b);
+    }
+    AbstractValue eval_terms(const vector<ExprTerm> &expr)
+    {
+        if (expr.empty())
+            return AbstractValue(string(""));
+        int64_t stack[EXPR_STACK_SIZE];
+        int sp = 0;
+        for (const ExprTerm &t : expr)
+        {
+            switch (t.kind)
+            {
+            case TERM_CONST:
+                stack[sp++] = t.value;
+                break;
+            case TERM_VAR:
+            case TERM_NAME:
+            {
+                const AbstractValue &var = vars[t.value];
+                if (var.getType() == VOID)
+                {
+                    if (t.kind == TERM_VAR)
+                        throw runtime_error("Undefined variable: " + var_name(t.value));
+                    throw runtime_error("Unsupported token: " + var_name(t.value));
+                }
+                stack[sp++] = var.getAsInt();
+                break;
+            }
+            case TERM_OP:
+                sp--;
+                stack[sp - 1] = apply_op(t.value, stack[sp - 1], stack[sp]);
+                break;
+            case TERM_DROP:
+                sp -= t.value;
+                break;
+            case TERM_ELEM:
+            {
+                const SiplArray &arr = array_at(t.value, stack[sp - 1]);
+                size_t index = stack[sp - 1];
+                stack[sp - 1] = arr.type == INTEGER ? arr.numbers[index] : stoll(arr.strings[index]);
+                break;
+            }
+            }
+        }
+        return stack[0];
+    }
+    static bool is_word_char(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+    // Splits PRNT text on $name references, the same matches handle_echo's regex finds
+    vector<PrintPiece> compile_template(const string &text)
+    {
+        vector<PrintPiece> pieces;
+        string literal;
+        for (size_t i = 0; i < text.size(); i++)
+        {
+            const char *dollar = (const char *)memchr(text.data() + i, '$', text.size() - i);
+            size_t next = dollar ? dollar - text.data() : text.size();
+            literal.append(text, i, next - i);
+            i = next;
+            if (i == text.size())
+                break;
+            size_t end = i + 1;
+            while (text[i] == '$' && end < text.size() && is_word_char(text[end]))
+                end++;
+            if (end == i + 1)
+            {
+                literal += text[i];
+                continue;
+            }
+            if (!literal.empty())
+                pieces.push_back({literal, -1});
+            literal.clear();
+            PrintPiece piece{text.substr(i, end - i), intern(text.substr(i + 1, end - i - 1))};
+            size_t close = end < text.size() && text[end] == '[' ? text.find(']', end) : string::npos;
+            if (close != string::npos)
+            {
+                string index = text.substr(end + 1, close - end - 1);
+                if (compile_index(index, piece.index_slot, piece.index))
+                {
+                    piece.element = true;
+                    piece.name_len = end - i;
+                    piece.text = text.substr(i, close + 1 - i);
+                    end = close + 1;
+                }
+            }
+            pieces.push_back(piece);
+            i = end - 1;
+        }
+        if (!literal.empty())
+            pieces.push_back({literal, -1});
+        return pieces;
+    }
+    void print_template(const vector<PrintPiece> &pieces)
+    {
+        string &buf = out.buffer();
+        size_t line_start = buf.size();
+        for (const PrintPiece &piece : pieces)
+        {
+            if (piece.element)
+            {
+                if (arrays[piece.slot].type == VOID)
+                {
+                    if (vars[piece.slot].getType() != VOID)
+                        vars[piece.slot].appendTo(buf);
+                    else
+                        buf.append(piece.text, 0, piece.name_len);
+                    buf.append(piece.text, piece.name_len, string::npos);
+                    continue;
+                }
+                // a bad index stops the program like in VAR, without the
+                // half printed line
+                int64_t index;
+                try
+                {
+                    index = index_of(piece.index_slot, piece.index);
+                    array_at(piece.slot, index);
+                }
+                catch (exception &)
+                {
+                    buf.resize(line_start);
+                    throw;
+                }
+                const SiplArray &arr = arrays[piece.slot];
+                if (arr.type == INTEGER)
+                    AbstractValue(arr.numbers[index]).appendTo(buf);
+                else
+                    buf += arr.strings[index];
+            }
+            else if (piece.slot != -1 && vars[piece.slot].getType() != VOID)
+                vars[piece.slot].appendTo(buf);
+            else
+                buf += piece.text;
+        }
+        out.end_line();
+    }
+    // Parses "var op value" into ins. Returns false if the condition is
+    // malformed, leaves ins.op at OP_FALLBACK if the comparison would always
+    // throw, so exec_line can report it like before.
+    bool compile_condition(const string &cond, Instruction &ins)
+    {
+        static const vector<pair<string, CompareOp>> ops{
+            {"==", CMP_EQ}, {"!=", CMP_NE}, {"<=", CMP_LE}, {">=", CMP_GE}, {"<", CMP_LT}, {">", CMP_GT}};
+        size_t pos = 0;
+        while (pos < cond.size() && is_word_char(cond[pos]))
+            pos++;
+        if (pos == 0)
+            return false;
+        ins.name = cond.substr(0, pos);
+        while (pos < cond.size() && isspace(cond[pos]))
+            pos++;
+        auto op = ops.begin();
+        while (op != ops.end() && cond.compare(pos, op->first.size(), op->first) != 0)
+            ++op;
+        if (op == ops.end())
+            return false;
+        ins.cmp = op->second;
+        pos += op->first.size();
+        while (pos < cond.size() && isspace(cond[pos]))
+            pos++;
+        string val = cond.substr(pos);
+        if (val.empty() || val.find_first_of("\r\n") != string::npos)
+            return false;
+        if (val.front() == '"' && val.back() == '"')
+            val = val.size() > 1 ? val.substr(1, val.size() - 2) : "";
+        ins.value = val;
+        try
+        {
+            ins.number = stoll(val);
+            ins.is_number = to_string(ins.number) == val;
+        }
+        catch (exception &e)
+        {
+            if (ins.cmp != CMP_EQ && ins.cmp != CMP_NE)
+                ins.op = OP_FALLBACK;
+        }
+        return true;
+    }
+    bool test_condition(const Instruction &ins)
+    {
+        return test_condition(ins, vars[ins.slot]);
+    }
+    bool test_condition(const Instruction &ins, const AbstractValue &var)
+    {
+        if (ins.cmp == CMP_EQ || ins.cmp == CMP_NE)
+        {
+            bool equal;
+            if (var.getType() == INTEGER)
+                equal = ins.is_number && var.getAsInt() == ins.number;
+            else if (var.getType() == STRING)
+                equal = var.handle() && ins.str ? var.handle() == ins.str : var.view() == ins.value;
+            else
+                equal = ins.value.empty();
+            return equal == (ins.cmp == CMP_EQ);
+        }
+        int64_t lhs = var.getType() == VOID ? stoll(string()) : var.getAsInt();
+        switch (ins.cmp)
+        {
+        case CMP_LT:
+            return lhs < ins.number;
+        case CMP_GT:
+            return lhs > ins.number;
+        case CMP_LE:
+            return lhs <= ins.number;
+        case CMP_GE:
+            return lhs >= ins.number;
+        default:
+            return false;
+        }
+    }
+    // Turns one source line into an instruction. Syntax errors are not reported
+    // here, the line becomes OP_FALLBACK and exec_line reports them when reached.
+    Instruction compile_line(const string &src)
+    {
+        Instruction ins;
+        ins.text = trim(src);
+        const string &line = ins.text;
+        if (line.empty() || line[0] == ':' || line[0] == '_')
+            return ins;
+        ins.op = OP_FALLBACK;
+        try
+        {
+            vector<string_view> arg = split_view(line, ' ');
             if (arg[0] == "PRNT")
             {
-                handle_echo(trim(line.substr(4)));
+                ins.op = OP_PRNT;
+                ins.value = trim(line.substr(4));
+                ins.pieces = compile_template(ins.value);
+            }
+            else if (arg[0] == "VAR")
+            {
+                if (arg.size() < 5 || arg[3] != "=")
+                    return ins;
+                ins.name = arg[2];
+                ins.value = trim(line.substr(line.find('=') + 1));
+                string elem_name, elem_index;
+                bool element = split_element(ins.name, elem_name, elem_index);
+                if (element)
+                {
+                    if (!is_word(elem_name) || !compile_index(elem_index, ins.index_slot, ins.index))
+                    {
+                        ins.op = OP_ERROR;
+                        ins.value = "Invalid array element " + ins.name;
+                        return ins;
+                    }
+                    ins.array = intern(elem_name);
+                }
+                if (arg[1] == "INT")
+                {
+                    string err;
+                    if (compile_expr(ins.value, ins.expr, err))
+                    {
+                        ins.op = element ? OP_SET_INT : OP_VAR_INT;
+                    }
+                    else if (!err.empty())
+                    {
+                        ins.op = OP_ERROR;
+                        ins.value = err;
+                    }
+                }
+                else if (arg[1] == "STR")
+                {
+                    ins.op = element ? OP_SET_STR : OP_VAR_STR;
+                    if (!ins.value.empty() && ins.value.front() == '"' && ins.value.back() == '"')
+                        ins.value = ins.value.substr(1, ins.value.size() - 2);
+                }
+            }
+            else if (arg[0] == "GOTO")
+            {
+                if (arg.size() < 2)
+                    return ins;
+                ins.op = OP_GOTO;
+                ins.name = arg[1];
+            }
+            else if (arg[0] == "IF")
+            {
+                string rest = trim(line.substr(2));
+                size_t colon = rest.find(':');
+                if (colon == string::npos)
+                    return ins;
+                ins.op = OP_IF;
+                if (!compile_condition(trim(rest.substr(0, colon)), ins))
+                {
+                    ins.op = OP_ERROR;
+                    ins.value = "Malformed condition in IF";
+                    return ins;
+                }
+                if (ins.op == OP_FALLBACK)
+                    return ins;
+                Instruction action = compile_line(trim(rest.substr(colon + 1)));
+                actions.push_back(action);
+                ins.action = actions.size() - 1;
+            }
+            else if (arg[0] == "INPT")
+            {
+                string rest = line.substr(4);
+                size_t colon = rest.find(':');
+                ins.name = trim(rest.substr(0, colon));
+                if (colon != string::npos)
+                    ins.value = trim(rest.substr(colon + 1)); // label for the end of the input
+                if (!ins.name.empty())
+                    ins.op = OP_INPT;
+            }
+            else if (arg[0] == "HLP")
+            {
+                ins.op = OP_HLP;
+            }
+            else if (arg[0] == "EXIT")
+            {
+                ins.op = OP_EXIT;
+            }
+            else if (arg[0] == "DMP" || arg[0] == "SNAP")
+            {
+                ins.op = arg[0] == "DMP" ? OP_DMP : OP_SNAP;
+                ins.value = trim(line.substr(arg[0].size()));
+            }
+            else if (arg[0] == "ARR")
+            {
+                if (arg.size() < 4 || (arg[1] != "INT" && arg[1] != "STR") || !is_word(string(arg[2])))
+                {
+                    ins.op = OP_ERROR;
+                    ins.value = "Invalid ARR syntax";
+                    return ins;
+                }
+                string size, err;
+                for (size_t a = 3; a < arg.size(); a++)
+                    size += (a > 3 ? " " : "") + string(arg[a]);
+                if (!compile_expr(size, ins.expr, err))
+                {
+                    ins.op = OP_ERROR;
+                    ins.value = err.empty() ? "Invalid array size " + size : err;
+                    return ins;
+                }
+                ins.op = OP_ARR;
+                ins.array = intern(string(arg[2]));
+                ins.number = arg[1] == "INT" ? INTEGER : STRING;
+            }
+            else if (arg[0] == "LEN" || arg[0] == "SUM" || arg[0] == "MIN" || arg[0] == "MAX")
+            {
+                if (arg.size() != 3 || !is_word(string(arg[1])) || !is_word(string(arg[2])))
+                {
+                    ins.op = OP_ERROR;
+                    ins.value = "Invalid " + string(arg[0]) + " syntax";
+                    return ins;
+                }
+                ins.op = arg[0] == "LEN" ? OP_LEN : arg[0] == "SUM" ? OP_SUM : arg[0] == "MIN" ? OP_MIN : OP_MAX;
+                ins.array = intern(string(arg[1]));
+                ins.name = arg[2];
+            }
+            else if (arg[0] == "FILL")
+            {
+                if (arg.size() < 3 || !is_word(string(arg[1])))
+                {
+                    ins.op = OP_ERROR;
+                    ins.value = "Invalid FILL syntax";
+                    return ins;
+                }
+                ins.op = OP_FILL;
+                ins.array = intern(string(arg[1]));
+                ins.value = trim(line.substr(line.find(arg[1], 4) + arg[1].size()));
+                // INT arrays use the expression, STR arrays the text
+                string err;
+                if (!compile_expr(ins.value, ins.expr, err))
+                    ins.expr.clear();
+                if (ins.value.size() > 1 && ins.value.front() == '"' && ins.value.back() == '"')
+                    ins.value = ins.value.substr(1, ins.value.size() - 2);
+            }
+            else if (arg[0] == "RNG")
+            {
+                if (arg.size() == 3)
+                {
+                    ins.max_value = stoi(string(arg[1]));
+                    ins.name = arg[2];
+                }
+                else if (arg.size() == 4)
+                {
+                    ins.min_value = stoi(string(arg[1]));
+                    ins.max_value = stoi(string(arg[2]));
+                    ins.name = arg[3];
+                }
+                else
+                {
+                    return ins;
+                }
+                if (ins.max_value > 0 && ins.min_value < ins.max_value)
+                    ins.op = OP_RNG;
+            }
+        }
+        catch (exception &e)
+        {
+            ins.op = OP_FALLBACK;
+        }
+        if (ins.op == OP_VAR_INT || ins.op == OP_VAR_STR || ins.op == OP_INPT || ins.op == OP_RNG || ins.op == OP_IF ||
+            ins.op == OP_LEN || ins.op == OP_SUM || ins.op == OP_MIN || ins.op == OP_MAX)
+            ins.slot = intern(ins.name);
+        return ins;
+    }
+    // Same contract as exec_line: 1 - continue, 0 - stop, -1 - EXIT, and
+    // 2 - INPT has no queued input yet, run the instruction again later
+    int exec_instr(const Instruction &ins, int &i)
+    {
+        try
+        {
+            switch (ins.op)
+            {
+            case OP_NOP:
+                DEBUG_PRINT("Line empty");
+                break;
+            case OP_PRNT:
+                print_template(ins.pieces);
+                break;
+            case OP_VAR_INT:
+                vars[ins.slot] = eval_terms(ins.expr);
+                break;
+            case OP_VAR_STR:
+                vars[ins.slot] = ins.str ? AbstractValue(ins.str) : AbstractValue(ins.value);
+                break;
+            case OP_GOTO:
+                DEBUG_PRINT("Jumping to line " + to_string(ins.target + 1));
+                i = ins.target - 1;
+                break;
+            case OP_INC:
+                increment(ins);
+                break;
+            case OP_BRANCH:
+                if (test_condition(ins))
+                {
+                    DEBUG_PRINT("Jumping to line " + to_string(ins.target + 1));
+                    i = ins.target - 1;
+                }
+                break;
+            case OP_INC_BRANCH:
+                // runs the next line, the OP_BRANCH, as well
+                increment(ins);
+                i++;
+                executed++;
+                debug_line(i);
+                try
+                {
+                    if (test_condition(program[i]))
+                    {
+                        DEBUG_PRINT("Jumping to line " + to_string(ins.target + 1));
+                        i = ins.target - 1;
+                    }
+                }
+                catch (exception &e)
+                {
+                    // reported against the IF line, like the unfused branch
+                    error(string("Exception: ") + e.what(), program[i].text);
+                    return 0;
+                }
+                break;
+            case OP_PRNT_CONST:
+                out.buffer() += ins.value;
+                out.end_line();
+                break;
+            case OP_IF:
+                // like exec_line, the action's result does not stop the
+                // program, but an INPT action waiting for input suspends the IF
+                if (test_condition(ins) && exec_instr(actions[ins.action], i) == 2)
+                    return 2;
+                break;
+            case OP_INPT:
+            {
+                string_view value;
+                out.flush();
+                if (queued_input)
+                {
+                    if (inbox.empty() && !inbox_closed)
+                        return 2;
+                    if (!inbox.empty())
+                    {
+                        vars[ins.slot] = make_str(trim_view(inbox.front()));
+                        inbox.pop_front();
+                        break;
+                    }
+                }
+                else if (read_input(value))
+                {
+                    vars[ins.slot] = make_str(trim_view(value));
+                    break;
+                }
+                if (ins.target != -1)
+                {
+                    DEBUG_PRINT("End of input, jumping to line " + to_string(ins.target + 1));
+                    i = ins.target - 1;
+                    break;
+                }
+                error(ins.value.empty() ? "Failed to read input" : "Label not found: " + ins.value, ins.text);
+                return 0;
+            }
+            case OP_HLP:
+                print_help();
+                break;
+            case OP_EXIT:
+                DEBUG_PRINT("Exiting.");
+                out.flush();
+                i = lines.size();
+                return -1;
+            case OP_DMP:
+                if (ins.value.empty())
+                    dump();
+                else if (!snapshot_line(ins.value, i, ins.text))
+                    return 0;
+                break;
+            case OP_SNAP:
+                if (!snapshot_line(ins.value.empty() ? snapshot_path : ins.value, i, ins.text))
+                    return 0;
+                break;
+            case OP_RNG:
+                if (arrays[ins.slot].type == INTEGER)
+                {
+                    vector<int64_t> &a = arrays[ins.slot].numbers;
+                    rng.fill(a.data(), a.size(), ins.min_value, ins.max_value);
+                }
+                else
+                {
+                    vars[ins.slot] = (int64_t)bounded_rand(ins.min_value, ins.max_value);
+                }
+                break;
+            case OP_ARR:
+            {
+                int64_t size = eval_terms(ins.expr).getAsInt();
+                if (size < 0)
+                    throw runtime_error("Negative array size " + to_string(size));
+                SiplArray &arr = arrays[ins.array];
+                arr = SiplArray();
+                arr.type = (AbstractType)ins.number;
+                if (arr.type == INTEGER)
+                    arr.numbers.assign(size, 0);
+                else
+                    arr.strings.assign(size, "");
+                break;
+            }
+            case OP_SET_INT:
+            {
+                int64_t index = index_of(ins.index_slot, ins.index);
+                int64_t value = eval_terms(ins.expr).getAsInt();
+                SiplArray &arr = array_at(ins.array, index);
+                if (arr.type == INTEGER)
+                    arr.numbers[index] = value;
+                else
+                    arr.strings[index] = to_string(value);
+                break;
+            }
+            case OP_SET_STR:
+            {
+                int64_t index = index_of(ins.index_slot, ins.index);
+                SiplArray &arr = array_at(ins.array, index);
+                if (arr.type == INTEGER)
+                    arr.numbers[index] = stoll(ins.value);
+                else
+                    arr.strings[index] = ins.value;
+                break;
+            }
+            case OP_LEN:
+                vars[ins.slot] = (int64_t)declared_array(ins.array).size();
+                break;
+            case OP_FILL:
+            {
+                SiplArray &arr = declared_array(ins.array);
+                if (arr.type == STRING)
+                {
+                    fill(arr.strings.begin(), arr.strings.end(), ins.value);
+                }
+                else
+                {
+                    if (ins.expr.empty())
+                        throw runtime_error("Invalid INT value " + ins.value);
+                    fill(arr.numbers.begin(), arr.numbers.end(), eval_terms(ins.expr).getAsInt());
+                }
+                break;
+            }
+            case OP_SUM:
+            {
+                const vector<int64_t> &a = int_array(ins.array).numbers;
+                int64_t sum = 0;
+                for (size_t e = 0; e < a.size(); e++)
+                    sum += a[e];
+                vars[ins.slot] = sum;
+                break;
+            }
+            case OP_MIN:
+            case OP_MAX:
+            {
+                const vector<int64_t> &a = int_array(ins.array).numbers;
+                if (a.empty())
+                    throw runtime_error(string(op_name(ins.op)) + " of an empty array " + var_name(ins.array));
+                int64_t best = a[0];
+                if (ins.op == OP_MIN)
+                {
+                    for (size_t e = 1; e < a.size(); e++)
+                        best = a[e] < best ? a[e] : best;
+                }
+                else
+                {
+                    for (size_t e = 1; e < a.size(); e++)
+                        best = a[e] > best ? a[e] : best;
+                }
+                vars[ins.slot] = best;
+                break;
+            }
+            case OP_ERROR:
+                error(ins.value, ins.text);
+                return 0;
+            case OP_FALLBACK:
+                return exec_line(ins.text, i);
+            }
+        }
+        catch (exception &e)
+        {
+            error(string("Exception: ") + e.what(), ins.text);
+            return 0;
+        }
+        return 1;
+    }
+    // Lexes the program, indexes labels and compiles it. Returns false if it
+    // can not run.
+    bool load(string_view program)
+    {
+        if (!compile_program(program))
+            return false;
+        prepare();
+        return true;
+    }
+    // Lexes, links and optimizes the program, what a .siplc file stores
+    bool compile_program(string_view program)
+    {
+        DEBUG_PRINT("Running in debug mode");
+        lines = vector<SourceLine>();
+        labels = map<int,string>();
+        label_index = unordered_map<string, int>();
+        vars = vector<AbstractValue>();
+        arrays = vector<SiplArray>();
+        var_names = vector<string>();
+        var_slots = unordered_map<string, int>();
+        this->program = vector<Instruction>();
+        actions = vector<Instruction>();
+        strings.clear();
+        addLines(program);
+
+        if (!index_labels())
+            return false;
+        if (legacy)
+            return true;
+
+        compiling = true;
+        compile_errors.clear();
+        for (const SourceLine &line : lines)
+        {
+            this->program.push_back(compile_line(string(line.text)));
+        }
+        link_program();
+        optimize();
+        compiling = false;
+        return true;
+    }
+    // The part of loading that depends on how the program is run
+    void prepare()
+    {
+        if (legacy)
+            return;
+        // the profiler reports per line, fused lines would be charged to the first one
+        if (!profiler)
+            fuse_program();
+        intern_literals();
+        jit_hits = vector<uint32_t>(this->program.size());
+        jit_regions = vector<unique_ptr<JitRegion>>(this->program.size());
+    }
+    // Runs the loaded program from line first. Returns false on EXIT. ip is
+    // left at the line a snapshot would continue at.
+    bool execute(int first = 0)
+    {
+        if (legacy)
+        {
+            ip = lines.size();
+            for (int i = first; i < lines.size(); ++i)
+            {
+                if (snapshot_on_exit && stop_requested)
+                {
+                    ip = i;
+                    return 0;
+                }
+                string line(lines[i].text);
+                DEBUG_PRINT("L " + to_string(i + 1) + " / " + to_string(lines.size()) + " : " + line);
+                executed++;
+                uint64_t started = profiler ? Profiler::now() : 0;
+                int from = i;
+                int res = exec_line(line, i);
+                if (profiler)
+                    profiler->record(from, i + 1, Profiler::now() - started);
+                if (res == 0)
+                {
+                    stopped = true;
+                    break;
+                }
+                else if (res == -1)
+                    return 0;
+            }
+            return 1;
+        }
+
+        ip = first;
+        return step(0) != RUN_EXIT;
+    }
+    // Runs the compiled program from ip until it ends, INPT finds no queued
+    // input or budget lines (0 - no limit) have run. ip is left at the line
+    // to continue at.
+    RunState step(uint64_t budget)
+    {
+        // per line output would not see the native code, and a native loop
+        // would not stop for the budget
+        bool use_jit = jit && !debug_verbose && !profiler && !tracer && !budget && !snapshot_on_exit && !metrics;
+        uint64_t limit = executed + budget;
+        for (int i = ip; i < this->program.size(); ++i)
+        {
+            if (budget && executed >= limit)
+            {
+                ip = i;
+                return RUN_BUDGET;
+            }
+            if (snapshot_on_exit && stop_requested)
+            {
+                ip = i;
+                return RUN_EXIT;
+            }
+            const Instruction &ins = this->program[i];
+            debug_line(i);
+            executed++;
+            uint64_t started = profiler ? Profiler::now() : 0;
+            bool sampled = metrics && executed % Metrics::SAMPLE == 0 && ins.op != OP_INPT;
+            auto sample_start = sampled ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+            int from = i;
+            int res = exec_instr(ins, i);
+            if (res == 2)
+            {
+                executed--;
+                ip = i;
+                return RUN_WAIT_INPUT;
+            }
+            if (metrics)
+            {
+                Metrics::add(metrics->ops[ins.op]);
+                if (sampled)
+                {
+                    Metrics::observe(metrics->latency, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - sample_start).count());
+                    if (metrics->refresh.load(memory_order_relaxed))
+                        update_metrics();
+                }
+            }
+            if (profiler)
+                profiler->record(from, i + 1, Profiler::now() - started);
+            if (tracer)
+                trace(from, ins);
+            if (res == 0)
+            {
+                stopped = true;
+                break;
+            }
+            else if (res == -1)
+            {
+                ip = this->program.size();
+                return RUN_EXIT;
+            }
+            // only taken jumps count, a fused INC_BRANCH that is not taken
+            // ends on the line it covers
+            int last = ins.op == OP_INC_BRANCH ? from + 1 : from;
+            if (use_jit && i != last && i + 1 < (int)this->program.size())
+                i = jit_enter(i + 1) - 1;
+        }
+        ip = this->program.size();
+        return RUN_DONE;
+    }
+    // Suspendable runs for SessionScheduler: begin() loads the program with
+    // INPT reading from the inbox, resume() runs the next slice of it
+    bool begin(string_view program)
+    {
+        legacy = false;
+        queued_input = true;
+        stopped = false;
+        ip = 0;
+        if (!load(program))
+        {
+            stopped = true;
+            ip = this->program.size();
+            return false;
+        }
+        return true;
+    }
+    RunState resume(uint64_t budget)
+    {
+        auto start = chrono::steady_clock::now();
+        RunState state = step(budget);
+        out.flush();
+        run_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        return state;
+    }
+    void give_input(string line)
+    {
+        inbox.push_back(move(line));
+    }
+    // INPT fails once the inbox is empty, like at the end of stdin
+    void close_input()
+    {
+        inbox_closed = true;
+    }
+    // Called after a jump to line target, runs the region there if it is
+    // hot and its variables are integers. Returns the line to continue at.
+    int jit_enter(int target)
+    {
+        unique_ptr<JitRegion> &region = jit_regions[target];
+        if (!region)
+        {
+            if (++jit_hits[target] != JIT_THRESHOLD)
+                return target;
+            region = jit_compile(target);
+            if (!region)
+                return target;
+            jit_compiled++;
+        }
+        JitRegion &r = *region;
+        for (size_t k = 0; k < r.slots.size(); k++)
+        {
+            const AbstractValue &var = vars[r.slots[k]];
+            if (var.getType() != INTEGER)
+                return target;
+            r.regs[k] = var.getAsInt();
+        }
+        r.entries++;
+        jit_entries++;
+        int next = r.entry()(r.regs.data(), &executed);
+        for (size_t k = 0; k < r.slots.size(); k++)
+            vars[r.slots[k]] = r.regs[k];
+        return next;
+    }
+    bool jit_supported(const Instruction &ins)
+    {
+        auto expr_ok = [](const vector<ExprTerm> &expr) {
+            return !expr.empty() && none_of(expr.begin(), expr.end(), [](const ExprTerm &t) { return t.kind == TERM_ELEM; });
+        };
+        switch (ins.op)
+        {
+        case OP_NOP:
+        case OP_GOTO:
+        case OP_INC:
+        case OP_BRANCH:
+        case OP_INC_BRANCH:
+            return true;
+        case OP_VAR_INT:
+            return expr_ok(ins.expr);
+        case OP_IF:
+        {
+            const Instruction &action = actions[ins.action];
+            return action.op == OP_NOP || action.op == OP_GOTO || action.op == OP_INC ||
+                   (action.op == OP_VAR_INT && expr_ok(action.expr));
+        }
+        default:
+            return false;
+        }
+    }
+    // Compiles the lines from start up to the first one the JIT does not
+    // handle. Jumps out of the region and the end of it return to the
+    // interpreter, expressions follow eval_terms term by term.
+    unique_ptr<JitRegion> jit_compile(int start)
+    {
+#ifdef SIPLI_JIT
+        int end = start;
+        while (end < program.size() && jit_supported(program[end]))
+            end++;
+        if (end - start < 2)
+            return nullptr;
+        auto region = make_unique<JitRegion>();
+        region->start = start;
+        region->end = end;
+        unordered_map<int, int> reg_of;
+        auto reg = [&](int slot) {
+            auto it = reg_of.find(slot);
+            if (it != reg_of.end())
+                return it->second;
+            region->slots.push_back(slot);
+            return reg_of[slot] = region->slots.size() - 1;
+        };
+
+        X64Emitter x;
+        x.prologue();
+        vector<size_t> line_pos(end - start);
+        vector<pair<size_t, int>> jumps; // rel32 to patch, line it goes to
+        auto emit_expr = [&](const vector<ExprTerm> &expr) {
+            int depth = 0;
+            for (const ExprTerm &t : expr)
+            {
+                switch (t.kind)
+                {
+                case TERM_CONST:
+                    if (depth++)
+                        x.push_rax();
+                    x.load_const(t.value);
+                    break;
+                case TERM_VAR:
+                case TERM_NAME:
+                    if (depth++)
+                        x.push_rax();
+                    x.load_reg(reg(t.value));
+                    break;
+                case TERM_OP:
+                    x.rcx_from_rax();
+                    x.pop_rax();
+                    depth--;
+                    // the prologue leaves rsp aligned, depth - 1 values are pushed
+                    x.op(t.value, jit_pow, (depth - 1) % 2 != 0);
+                    break;
+                case TERM_DROP:
+                    x.load_rsp(t.value - 1);
+                    x.add_rsp(8 * t.value);
+                    depth -= t.value;
+                    break;
+                default:
+                    break;
+                }
+            }
+            // the result is the bottom of the stack
+            if (depth > 1)
+            {
+                x.load_rsp(depth - 2);
+                x.add_rsp(8 * (depth - 1));
+            }
+        };
+        // A jump taken when test_condition(cond) == when, npos if it never is.
+        // The variables are integers, so == and != against text never match.
+        auto emit_branch = [&](const Instruction &cond, bool when) -> size_t {
+            if ((cond.cmp == CMP_EQ || cond.cmp == CMP_NE) && !cond.is_number)
+                return (cond.cmp == CMP_NE) == when ? x.jmp() : string::npos;
+            static const uint8_t jcc[] = {0x84, 0x85, 0x8C, 0x8F, 0x8E, 0x8D}; // je jne jl jg jle jge
+            x.load_const(cond.number);
+            x.rcx_from_rax();
+            x.load_reg(reg(cond.slot));
+            x.cmp_rax_rcx();
+            return x.jcc(when ? jcc[cond.cmp] : jcc[cond.cmp] ^ 1);
+        };
+        auto emit_action = [&](const Instruction &ins) {
+            if (ins.op == OP_VAR_INT)
+            {
+                emit_expr(ins.expr);
+                x.store_reg(reg(ins.slot));
+            }
+            else if (ins.op == OP_INC || ins.op == OP_INC_BRANCH)
+            {
+                x.add_reg(reg(ins.slot), ins.delta);
+            }
+        };
+        for (int l = start; l < end; l++)
+        {
+            line_pos[l - start] = x.code.size();
+            const Instruction &ins = program[l];
+            x.count(ins.op == OP_INC_BRANCH ? 2 : 1);
+            switch (ins.op)
+            {
+            case OP_VAR_INT:
+            case OP_INC:
+                emit_action(ins);
+                break;
+            case OP_GOTO:
+                jumps.push_back({x.jmp(), ins.target});
+                break;
+            case OP_BRANCH:
+            case OP_INC_BRANCH:
+            {
+                emit_action(ins);
+                size_t taken = emit_branch(ins.op == OP_BRANCH ? ins : program[l + 1], true);
+                if (taken != string::npos)
+                    jumps.push_back({taken, ins.target});
+                if (ins.op == OP_INC_BRANCH)
+                    jumps.push_back({x.jmp(), l + 2});
+                break;
             }
-            else if (arg[0] == "VAR")
+            case OP_IF:
             {
-                if (arg.size() < 5 || arg[3] != "="){
-                    error("Invalid VAR syntax", line);
-                }
-                string type = arg[1];
-                string name = arg[2];
-                string val = trim(line.substr(line.find('=') + 1));
-
-                if (type == "INT"){
-                    string evaluated = eval_expr(val);
-                    vars[name] = evaluated;
-                }
-                else if (type == "STR"){
-                    if (val.front() == '"' && val.back() == '"')
-                    val = val.substr(1, val.size() - 2);
-                    vars[name] = val;
-                }
-                else{
-                    error("Invalid type", line);
-                    return 0;
+                const Instruction &action = actions[ins.action];
+                if (action.op == OP_GOTO)
+                {
+                    size_t taken = emit_branch(ins, true);
+                    if (taken != string::npos)
+                        jumps.push_back({taken, action.target});
+                    break;
                 }
+                size_t skip = emit_branch(ins, false);
+                emit_action(action);
+                if (skip != string::npos)
+                    x.patch(skip, x.code.size());
+                break;
             }
-            else if (arg[0] == "GOTO")
+            default:
+                break;
+            }
+        }
+        vector<size_t> exits;
+        x.exit_with(end);
+        exits.push_back(x.jmp());
+        unordered_map<int, size_t> stubs; // lines outside the region
+        for (auto &jump : jumps)
+        {
+            int line = jump.second;
+            if (line >= start && line < end)
             {
-                string label = arg[1];
-                int labelpos = find_label(label);
-                if(labelpos==-1){
-                    error("Label not found: " + label, line);
-                }
-                else{
-                    debug_print("Label found at line " + to_string(i + 1) + ", jumping");
-                    i = labelpos - 1;
-                }
+                x.patch(jump.first, line_pos[line - start]);
+                continue;
             }
-            else if (arg[0] == "IF")
+            auto stub = stubs.find(line);
+            if (stub == stubs.end())
             {
-                string rest = trim(line.substr(2));
-                size_t colon = rest.find(':');
-                if (colon == string::npos)
-                {
-                    error("Invalid IF syntax", line);
-                }
-                string condition = trim(rest.substr(0, colon));
-                string action = trim(rest.substr(colon + 1));
-                // TODO: remove and replace with expression handler
-                regex comp_regex(R"((\w+)\s*(==|!=|<|>|<=|>=)\s*(\"?.+?\"?))");
-                smatch match;
-                if (regex_match(condition, match, comp_regex))
-                {
-                    debug_print("IF REGEX DUMP");
-                    for (int i = 0; i < match.length(); i++)
-                    {
-                        string data = match[i];
-                        debug_print("[" + to_string(i) + "] " + data);
-                    }
-                    debug_print("END IF REGEX DUMP");
-                    string var = match[1];
-                    string op = match[2];
-                    string val = match[3];
+                stub = stubs.insert({line, x.code.size()}).first;
+                x.exit_with(line);
+                exits.push_back(x.jmp());
+            }
+            x.patch(jump.first, stub->second);
+        }
+        size_t epilogue = x.code.size();
+        x.epilogue();
+        for (size_t e : exits)
+            x.patch(e, epilogue);
 
-                    string var_val = vars.count(var) ? vars[var].getAsString() : "";
-                    bool cond_met = false;
+        region->regs.resize(region->slots.size());
+        if (!x.finish(*region))
+            return nullptr;
+        return region;
+#else
+        return nullptr;
+#endif
+    }
+    // false where there is no JIT for the platform
+    bool enable_jit()
+    {
+#ifdef SIPLI_JIT
+        jit = !legacy;
+        return true;
+#else
+        return false;
+#endif
+    }
+    bool run(string_view program)
+    {
+        auto start = chrono::steady_clock::now();
+        return run_loaded(load(program), start);
+    }
+    // Runs a .siplc file, cache has to stay mapped while it runs. Returns
+    // false on EXIT like run(), sets cache_ok to whether the file was usable.
+    bool run_cache(string_view cache, uint64_t source_hash, bool &cache_ok)
+    {
+        auto start = chrono::steady_clock::now();
+        cache_ok = load_cache(cache, source_hash);
+        if (!cache_ok)
+            return 1;
+        prepare();
+        return run_loaded(true, start);
+    }
+    bool run_loaded(bool loaded, chrono::steady_clock::time_point start, int first = 0)
+    {
+        if (loaded && !resume_state.empty())
+        {
+            loaded = restore_snapshot(resume_state, first);
+            resume_state = string_view();
+        }
+        auto loaded_at = chrono::steady_clock::now();
+        if (profiler)
+            profiler->reset(lines.size());
+        uint64_t started = Profiler::now();
+        stopped = !loaded;
+        bool ret = loaded ? execute(first) : 1;
+        if (loaded && snapshot_on_exit)
+        {
+            if (!write_snapshot(snapshot_path, ip))
+                error("Could not write snapshot " + snapshot_path);
+            else if (stop_requested)
+            {
+                out.flush();
+                err.write_line("[SNAP] stopped at line " + to_string(ip < lines.size() ? lines[ip].line : 0) + ", saved to " + snapshot_path);
+            }
+        }
+        if (metrics)
+            update_metrics();
+        if (tracer)
+            print_trace(!ret ? "EXIT" : stopped ? "stopped by an error" : "finished");
+        if (profiler)
+        {
+            profiler->run_cycles = Profiler::now() - started;
+            profiler->run_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - loaded_at).count();
+        }
+        DEBUG_PRINT("Strings: " + to_string(pooled_values) + " pooled and " + to_string(heap_values) + " unpooled runtime values, pool " +
+                    to_string(strings.bytes + local_strings.bytes) + " bytes in " + to_string(strings.allocs + local_strings.allocs) + " blocks");
+        pooled_values = heap_values = 0;
+        out.flush();
+        load_ns += chrono::duration_cast<chrono::nanoseconds>(loaded_at - start).count();
+        run_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - loaded_at).count();
+        return ret;
+    }
+    // REPL input: appends text to the loaded program, compiles only its
+    // lines and runs from the first of them. Variables, labels and earlier
+    // lines stay, so GOTO can go back to them. The optimizer does not run,
+    // later input could jump anywhere. Returns false on EXIT.
+    bool run_appended(string text)
+    {
+        auto start = chrono::steady_clock::now();
+        repl_source.push_back(move(text));
+        int first = addLines(repl_source.back());
+        if (!index_labels(first))
+        {
+            // forget the whole input, like a file with a duplicate label
+            for (auto it = labels.lower_bound(first); it != labels.end(); it = labels.erase(it))
+                label_index.erase(it->second);
+            lines.resize(first);
+            repl_source.pop_back();
+            return 1;
+        }
+        int first_action = actions.size();
+        for (int i = first; i < lines.size(); i++)
+            program.push_back(compile_line(string(lines[i].text)));
+        link_program(first, first_action);
+        fuse_program(first);
+        intern_literals(first, first_action);
+        jit_hits.resize(program.size());
+        jit_regions.resize(program.size());
+        return run_loaded(true, start, first);
+    }
+    static const char *op_name(OpCode op)
+    {
+        return OP_NAMES[op];
+    }
+    void enable_tracer()
+    {
+        tracer = make_unique<TraceRing>();
+    }
+    void trace(int index, const Instruction &ins)
+    {
+        TraceRecord &r = tracer->push();
+        r.line = index;
+        r.op = ins.op;
+        r.slot = ins.slot;
+        r.type = VOID;
+        if (ins.slot == -1)
+            return;
+        const AbstractValue &var = vars[ins.slot];
+        r.type = var.getType();
+        if (r.type == INTEGER)
+        {
+            r.number = var.getAsInt();
+        }
+        else if (r.type == STRING)
+        {
+            string value = var.getAsString();
+            r.number = value.size();
+            strncpy(r.text, value.c_str(), sizeof(r.text) - 1);
+            r.text[sizeof(r.text) - 1] = 0;
+        }
+    }
+    void print_trace(const string &reason)
+    {
+        vector<const TraceRecord *> records = tracer->recent();
+        out.flush();
+        err.write_line("[TRACE] last " + to_string(records.size()) + " of " + to_string(tracer->total()) + " instructions (" + reason + ")");
+        for (const TraceRecord *r : records)
+        {
+            string row = "[TRACE] #" + to_string(r->seq) + " line " + to_string(lines[r->line].line) + " " + op_name(r->op);
+            if (r->slot != -1)
+            {
+                row += " " + var_name(r->slot);
+                if (r->type == INTEGER)
+                    row += " = " + to_string(r->number);
+                else if (r->type == STRING)
+                    row += " = \"" + string(r->text) + (r->number >= sizeof(r->text) ? "...\"" : "\"");
+                else
+                    row += " undefined";
+            }
+            err.write_line(row);
+        }
+        err.flush();
+    }
+    void enable_profiler()
+    {
+        profiler = make_unique<Profiler>();
+    }
+    Metrics &enable_metrics()
+    {
+        metrics = make_unique<Metrics>();
+        return *metrics;
+    }
+    // Recomputes the --metrics gauges, walks every variable and array
+    void update_metrics()
+    {
+        uint64_t count = 0, bytes = 0, array_count = 0, array_bytes = 0;
+        for (const AbstractValue &var : vars)
+        {
+            if (var.getType() == VOID)
+                continue;
+            count++;
+            bytes += sizeof(AbstractValue) + (var.getType() == STRING && !var.handle() ? var.view().size() : 0);
+        }
+        for (const SiplArray &arr : arrays)
+        {
+            if (arr.type == VOID)
+                continue;
+            array_count++;
+            array_bytes += arr.numbers.size() * sizeof(int64_t) + arr.strings.size() * sizeof(string);
+            for (const string &text : arr.strings)
+                array_bytes += text.size();
+        }
+        Metrics::set(metrics->variables, count);
+        Metrics::set(metrics->variable_bytes, bytes);
+        Metrics::set(metrics->arrays, array_count);
+        Metrics::set(metrics->array_bytes, array_bytes);
+        Metrics::set(metrics->pool_bytes, strings.bytes + local_strings.bytes);
+        metrics->refresh.store(false, memory_order_relaxed);
+    }
+    // Hottest lines and jumps on stderr
+    void print_profile(int top = 20)
+    {
+        if (!profiler)
+            return;
+        const Profiler &p = *profiler;
+        double ns = p.ns_per_cycle();
+        uint64_t total = 0;
+        for (uint64_t c : p.cycles)
+            total += c;
+        vector<int> order;
+        for (int i = 0; i < p.counts.size(); i++)
+        {
+            if (p.counts[i])
+                order.push_back(i);
+        }
+        sort(order.begin(), order.end(), [&p](int a, int b) { return p.cycles[a] > p.cycles[b]; });
+        if (order.size() > top)
+            order.resize(top);
 
-                    if (val.front() == '"' && val.back() == '"')
-                        val = val.substr(1, val.size() - 2);
+        char row[128];
+        out.flush();
+        err.write_line("[PROFILE] " + to_string(executed) + " lines executed in " + to_string(p.run_ns / 1000000.0) + " ms");
+        snprintf(row, sizeof(row), "%6s %12s %12s %7s  %s", "line", "count", "time ms", "time %", "source");
+        err.write_line(row);
+        for (int i : order)
+        {
+            snprintf(row, sizeof(row), "%6d %12llu %12.3f %6.2f%%  ", lines[i].line, (unsigned long long)p.counts[i],
+                     p.cycles[i] * ns / 1e6, total ? 100.0 * p.cycles[i] / total : 0.0);
+            err.write_line(row + first_line(lines[i].text));
+        }
 
-                    if (op == "==")
-                        cond_met = (var_val == val);
-                    else if (op == "!=")
-                        cond_met = (var_val != val);
-                    else
-                    {
-                        int lhs = stoi(var_val);
-                        int rhs = stoi(val);
-                        if (op == "<")
-                            cond_met = lhs < rhs;
-                        else if (op == ">")
-                            cond_met = lhs > rhs;
-                        else if (op == "<=")
-                            cond_met = lhs <= rhs;
-                        else if (op == ">=")
-                            cond_met = lhs >= rhs;
-                    }
+        vector<pair<uint64_t, uint64_t>> jumps(p.jumps.begin(), p.jumps.end());
+        sort(jumps.begin(), jumps.end(), [](const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64_t> &b) { return a.second > b.second; });
+        if (jumps.size() > top)
+            jumps.resize(top);
+        if (!jumps.empty())
+        {
+            err.write_line("[PROFILE] jumps");
+            snprintf(row, sizeof(row), "%6s -> %-6s %12s", "from", "to", "count");
+            err.write_line(row);
+        }
+        for (auto &jump : jumps)
+        {
+            int from = jump.first >> 32, to = (uint32_t)jump.first;
+            snprintf(row, sizeof(row), "%6d -> %-6s %12llu", lines[from].line,
+                     to < lines.size() ? to_string(lines[to].line).c_str() : "end", (unsigned long long)jump.second);
+            err.write_line(row);
+        }
+        err.flush();
+    }
+    // Writes the profile as JSON if path ends in .json, as collapsed stacks
+    // (one "file;line source nanoseconds" per line, for flamegraph.pl) otherwise
+    bool write_profile(const string &path, const string &source_name)
+    {
+        if (!profiler)
+            return false;
+        ofstream file(path);
+        if (!file.is_open())
+        {
+            error("Could not write profile to " + path);
+            return false;
+        }
+        const Profiler &p = *profiler;
+        double ns = p.ns_per_cycle();
+        bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+        if (!json)
+        {
+            for (int i = 0; i < p.counts.size(); i++)
+            {
+                if (!p.counts[i])
+                    continue;
+                string frame = first_line(lines[i].text);
+                replace(frame.begin(), frame.end(), ';', ',');
+                file << source_name << ";" << lines[i].line << " " << frame << " " << (uint64_t)(p.cycles[i] * ns) << "\n";
+            }
+            return true;
+        }
+        file << "{\"file\":\"" << json_escape(source_name) << "\",\"run_ns\":" << p.run_ns << ",\"lines\":[";
+        bool first = true;
+        for (int i = 0; i < p.counts.size(); i++)
+        {
+            if (!p.counts[i])
+                continue;
+            file << (first ? "" : ",") << "{\"line\":" << lines[i].line << ",\"count\":" << p.counts[i]
+                 << ",\"ns\":" << (uint64_t)(p.cycles[i] * ns) << ",\"source\":\"" << json_escape(string(lines[i].text)) << "\"}";
+            first = false;
+        }
+        file << "],\"jumps\":[";
+        first = true;
+        for (auto &jump : p.jumps)
+        {
+            int from = jump.first >> 32, to = (uint32_t)jump.first;
+            file << (first ? "" : ",") << "{\"from\":" << lines[from].line << ",\"to\":"
+                 << (to < lines.size() ? lines[to].line : -1) << ",\"count\":" << jump.second << "}";
+            first = false;
+        }
+        file << "]}\n";
+        return true;
+    }
+    static string first_line(string_view text)
+    {
+        return string(text.substr(0, text.find('\n')));
+    }
+    static string json_escape(const string &s)
+    {
+        string ret;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                ret += '\\';
+            if (c == '\n')
+                ret += "\\n";
+            else if ((unsigned char)c < 0x20)
+                ret += ' ';
+            else
+                ret += c;
+        }
+        return ret;
+    }
+    uint64_t executed_count() const
+    {
+        return executed;
+    }
+    uint64_t error_count() const
+    {
+        return errors;
+    }
+    int64_t elapsed_ns() const
+    {
+        return load_ns + run_ns;
+    }
+    // One machine readable line on stderr, read by sipli-bench
+    void print_stats()
+    {
+        err.write_line("[STATS] parse_ns=" + to_string(load_ns) + " run_ns=" + to_string(run_ns) +
+                       " instructions=" + to_string(executed) + " lines=" + to_string(lines.size()) +
+                       (jit ? " jit_regions=" + to_string(jit_compiled) + " jit_entries=" + to_string(jit_entries) : ""));
+        err.flush();
+    }
+};
 
-                    if (cond_met)
-                    {
-                        exec_line(action, i);
-                    }
-                }
-                else
-                {
-                    error("Malformed condition in IF", line);
-                    return 0;
-                }
+// Settings every --batch interpreter gets
+struct BatchOptions
+{
+    bool debug = 0, legacy = 0, jit = 0, trace = 0, stats = 0, seeded = 0;
+    int opt_level = 1;
+    uint64_t seed = 0;
+    int jobs = 0;    // 0 - one per core
+    string out_dir;  // write name.out and name.err there instead of printing
+};
+
+// --batch: runs many scripts at once, each in its own Interpreter with its
+// output captured. Scripts are dealt to per-worker queues, a worker whose
+// queue runs dry steals from the others, results are printed in order.
+class BatchRunner
+{
+    struct Result
+    {
+        string path;
+        string out, err;
+        uint64_t errors = 0, executed = 0;
+        int64_t ns = 0;
+        bool done = false;
+    };
+    BatchOptions opt;
+    vector<Result> results;
+    vector<deque<int>> queues;
+    vector<unique_ptr<mutex>> queue_locks;
+    mutex done_lock;
+    condition_variable done_cv;
+
+    // own queue from the front so results come in roughly in order,
+    // stolen work from the back
+    bool take(int worker, int &script)
+    {
+        for (int k = 0; k < queues.size(); k++)
+        {
+            int from = (worker + k) % queues.size();
+            lock_guard<mutex> guard(*queue_locks[from]);
+            deque<int> &q = queues[from];
+            if (q.empty())
+                continue;
+            if (k == 0)
+            {
+                script = q.front();
+                q.pop_front();
             }
-            else if (arg[0] == "INPT")
+            else
             {
-                string varname = trim(line.substr(4));
-                if (varname.empty())
-                {
-                    error("Missing variable name for INPT", line);
-                    return 0;
-                }
-                string value;
-                if (!getline(cin, value))
-                {
-                    error("Failed to read input", line);
-                    return 0;
-                }
-                vars[varname] = trim(value);
+                script = q.back();
+                q.pop_back();
             }
-            else if (arg[0] == "HLP")
+            return true;
+        }
+        return false;
+    }
+    void work(int worker)
+    {
+        int script;
+        while (take(worker, script))
+            run_one(results[script]);
+    }
+    void run_one(Result &r)
+    {
+        auto start = chrono::steady_clock::now();
+        {
+            SourceFile file;
+            istringstream input; // there is no stdin for batch scripts, INPT fails
+            if (!file.open(r.path))
             {
-                print_help();
+                r.err = "[ERROR] Could not open file.\n";
+                r.errors = 1;
             }
-            else if (arg[0] == "EXIT")
+            else
             {
-                debug_print("Exiting.");
-                i = lines.size();
-                return -1;
+                Interpreter x(r.out, r.err, input, opt.debug, opt.legacy);
+                x.set_opt_level(opt.opt_level);
+                if (opt.trace)
+                    x.enable_tracer();
+                if (opt.jit)
+                    x.enable_jit();
+                if (opt.seeded)
+                    x.seed(opt.seed);
+                x.run(file.text());
+                if (opt.stats)
+                    x.print_stats();
+                r.errors = x.error_count();
+                r.executed = x.executed_count();
             }
-            else if (arg[0] == "DMP")
+        }
+        r.ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        if (!opt.out_dir.empty())
+        {
+            string base = r.path.substr(r.path.find_last_of('/') + 1);
+            ofstream(opt.out_dir + "/" + base + ".out") << r.out;
+            ofstream(opt.out_dir + "/" + base + ".err") << r.err;
+        }
+        {
+            lock_guard<mutex> guard(done_lock);
+            r.done = true;
+        }
+        done_cv.notify_all();
+    }
+
+public:
+    BatchRunner(const BatchOptions &opt)
+    {
+        this->opt = opt;
+    }
+    // A directory (its .sipl files) or a file with one path per line
+    static bool list_scripts(const string &from, vector<string> &paths)
+    {
+        struct stat st;
+        if (stat(from.c_str(), &st) != 0)
+            return false;
+        if (S_ISDIR(st.st_mode))
+        {
+            DIR *dir = opendir(from.c_str());
+            if (!dir)
+                return false;
+            while (dirent *entry = readdir(dir))
             {
-                debug_print("PROGRAM DATA DUMP:");
-                debug_print("## LABELS:");
-                for (pair<int, string> label : labels)
-                {
-                    debug_print("- " + label.second + " at line " + to_string(label.first + 1));
-                }
-                debug_print("## VARIABLES:");
-                for (pair<string, AbstractValue> var : vars)
-                {
-                    debug_print("- " + var.first + " = " + var.second.getAsString());
-                }
-                debug_print("## ARRAYS:");
-                for (pair<string, vector<string>> arr : arrays)
-                {
-                    debug_print("- " + arr.first);
-                    for (string v : arr.second)
-                    {
-                        debug_print("| - " + v);
-                    }
-                }
-                cout << "P. S. If you see no output, you might have debug mode disabled.\n";
+                string name = entry->d_name;
+                if (name.size() > 5 && name.compare(name.size() - 5, 5, ".sipl") == 0)
+                    paths.push_back(from + "/" + name);
             }
-            else if (arg[0] == "RNG")
+            closedir(dir);
+            sort(paths.begin(), paths.end());
+            return true;
+        }
+        ifstream list(from);
+        string line;
+        while (getline(list, line))
+        {
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start != string::npos)
+                paths.push_back(line.substr(start, line.find_last_not_of(" \t\r") + 1 - start));
+        }
+        return true;
+    }
+    // Returns the number of scripts that reported errors
+    int run(const vector<string> &paths)
+    {
+        auto start = chrono::steady_clock::now();
+        int jobs = opt.jobs > 0 ? opt.jobs : max(1u, thread::hardware_concurrency());
+        jobs = max(1, min<int>(jobs, paths.size()));
+        results = vector<Result>(paths.size());
+        queues = vector<deque<int>>(jobs);
+        queue_locks.clear();
+        for (int w = 0; w < jobs; w++)
+            queue_locks.push_back(make_unique<mutex>());
+        for (int i = 0; i < paths.size(); i++)
+        {
+            results[i].path = paths[i];
+            queues[i % jobs].push_back(i);
+        }
+        vector<thread> workers;
+        for (int w = 0; w < jobs; w++)
+            workers.emplace_back(&BatchRunner::work, this, w);
+
+        for (Result &r : results)
+        {
             {
-                int min_value = 0;
-                int max_value = 0;
-                string var_name = "";
-                bool failed = false;
-                if (arg.size() == 3)
-                {
-                    max_value = stoi(arg[1]);
-                    var_name = arg[2];
-                }
-                else if (arg.size() == 4)
-                {
-                    min_value = stoi(arg[1]);
-                    max_value = stoi(arg[2]);
-                    var_name = arg[3];
-                }
-                else
-                {
-                    error("Not enough or too many arguments for RNG");
-                    failed = true;
-                }
-                if (max_value <= 0)
-                {
-                    error("Maximum value for RNG should not be less than or equal to zero.");
-                    failed = true;
-                }
-                if(min_value >= max_value){
-                    error("The minimum value for RNG could not be larger than the maximum value.");
-                }
-                if (!failed)
-                {
-                    vars[var_name] = to_string(bounded_rand(min_value,max_value));
-                }
+                unique_lock<mutex> guard(done_lock);
+                done_cv.wait(guard, [&r]() { return r.done; });
             }
-            else
+            if (opt.out_dir.empty())
             {
-                cout << "Unknown command: " << line << endl;
-                return 0;
+                cout.write(r.out.data(), r.out.size()).flush();
+                cerr.write(r.err.data(), r.err.size()).flush();
             }
+            r.out = string();
+            r.err = string();
         }
-        catch (exception &e)
+        for (thread &t : workers)
+            t.join();
+
+        int failed = 0;
+        int64_t total_ns = 0;
+        for (const Result &r : results)
         {
-            error(string("Exception: ") + e.what(), line);
-            return 0;
+            total_ns += r.ns;
+            if (r.errors)
+            {
+                failed++;
+                cerr << "[BATCH] FAILED " << r.path << " (" << r.errors << (r.errors == 1 ? " error)" : " errors)") << endl;
+            }
         }
-        return 1;
+        vector<const Result *> slowest;
+        for (const Result &r : results)
+            slowest.push_back(&r);
+        sort(slowest.begin(), slowest.end(), [](const Result *a, const Result *b) { return a->ns > b->ns; });
+        slowest.resize(min<size_t>(slowest.size(), 5));
+        for (const Result *r : slowest)
+            cerr << "[BATCH] " << r->ns / 1e6 << " ms " << r->path << " (" << r->executed << " lines executed)" << endl;
+        int64_t wall_ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        cerr << "[BATCH] " << results.size() << " scripts, " << failed << " failed, " << jobs << " threads, "
+             << wall_ns / 1e6 << " ms wall, " << total_ns / 1e6 << " ms in scripts" << endl;
+        return failed;
     }
-    bool run(const string &program)
+};
+
+// Interleaves many suspendable interpreters on a few threads. A session
+// runs for at most budget lines at a time, sessions waiting in INPT are
+// parked until give_input() or close_input() reaches them.
+class SessionScheduler
+{
+    struct Session
     {
-        debug_print("Running in debug mode");
-        lines = vector<string>();
-        labels = map<int,string>();
-        vars = map<string, AbstractValue>();
-        addLines(program);
+        unique_ptr<Interpreter> x;
+        string out, err;       // captured by x, moved to output after a slice
+        string output;         // not yet taken by take_output()
+        deque<string> pending; // input not yet handed to x
+        bool closed = false;
+        bool waiting = false;  // suspended in INPT
+        bool queued = false;   // in ready, or being run
+        bool done = false;
+        uint64_t slices = 0;
+    };
+    vector<unique_ptr<Session>> sessions;
+    deque<int> ready;
+    vector<int> blocked; // waiting for input nobody has given yet
+    mutex lock;
+    condition_variable work_cv;  // ready got a session or shutdown
+    condition_variable event_cv; // a session started waiting or finished
+    vector<thread> workers;
+    uint64_t budget;
+    int running = 0; // sessions not done
+    bool shutdown = false;
 
-        for (int i = 0; i < lines.size(); ++i)
+    // with the lock held
+    void make_ready(int id)
+    {
+        Session &s = *sessions[id];
+        if (s.queued || s.done)
+            return;
+        s.queued = true;
+        s.waiting = false;
+        ready.push_back(id);
+        work_cv.notify_one();
+    }
+    void work()
+    {
+        unique_lock<mutex> guard(lock);
+        while (true)
         {
-            string line = trim(lines[i]);
-            if (!line.empty() && line[0] == ':')
+            work_cv.wait(guard, [this]() { return shutdown || !ready.empty(); });
+            if (shutdown)
+                return;
+            int id = ready.front();
+            ready.pop_front();
+            Session &s = *sessions[id];
+            for (string &line : s.pending)
+                s.x->give_input(move(line));
+            s.pending.clear();
+            if (s.closed)
+                s.x->close_input();
+            guard.unlock();
+
+            RunState state = s.x->resume(budget);
+
+            guard.lock();
+            s.slices++;
+            s.output += s.out;
+            s.output += s.err;
+            s.out.clear();
+            s.err.clear();
+            s.queued = false;
+            if (state == RUN_BUDGET)
             {
-                string label = trim(line.substr(1));
-                debug_print("Found label " + label + " at line " + to_string(i + 1));
-                labels[i] = label;
+                make_ready(id);
+                continue;
+            }
+            if (state == RUN_WAIT_INPUT)
+            {
+                s.waiting = true;
+                // input may have come in while it was running
+                if (!s.pending.empty() || s.closed)
+                {
+                    make_ready(id);
+                    continue;
+                }
+                blocked.push_back(id);
+            }
+            else
+            {
+                s.done = true;
+                running--;
             }
+            event_cv.notify_all();
         }
+    }
 
-        for (int i = 0; i < lines.size(); ++i)
+public:
+    SessionScheduler(int threads, uint64_t budget)
+    {
+        this->budget = budget;
+        for (int t = 0; t < max(1, threads); t++)
+            workers.emplace_back(&SessionScheduler::work, this);
+    }
+    ~SessionScheduler()
+    {
         {
-            string line = trim(lines[i]);
-            debug_print("L " + to_string(i + 1) + " / " + to_string(lines.size()) + " : " + line);
-            int res = exec_line(line, i);
-            if (res == 0)
-                break;
-            else if (res == -1)
-                return 0;
+            lock_guard<mutex> guard(lock);
+            shutdown = true;
         }
-        return 1;
+        work_cv.notify_all();
+        for (thread &t : workers)
+            t.join();
+    }
+    // Starts program in a new session, returns its id. program has to stay
+    // valid until the session is done.
+    int add(string_view program, bool debug = 0, bool seeded = 0, uint64_t seed = 0)
+    {
+        auto s = make_unique<Session>();
+        static istringstream no_input; // INPT uses the inbox
+        s->x = make_unique<Interpreter>(s->out, s->err, no_input, debug);
+        if (seeded)
+            s->x->seed(seed);
+        bool loaded = s->x->begin(program);
+        lock_guard<mutex> guard(lock);
+        int id = sessions.size();
+        s->output = s->out + s->err;
+        s->out.clear();
+        s->err.clear();
+        s->done = !loaded;
+        sessions.push_back(move(s));
+        if (loaded)
+        {
+            running++;
+            make_ready(id);
+        }
+        return id;
+    }
+    void give_input(int id, string line)
+    {
+        lock_guard<mutex> guard(lock);
+        Session &s = *sessions[id];
+        s.pending.push_back(move(line));
+        if (s.waiting)
+            make_ready(id);
+    }
+    void close_input(int id)
+    {
+        lock_guard<mutex> guard(lock);
+        Session &s = *sessions[id];
+        s.closed = true;
+        if (s.waiting)
+            make_ready(id);
+    }
+    string take_output(int id)
+    {
+        lock_guard<mutex> guard(lock);
+        string ret;
+        ret.swap(sessions[id]->output);
+        return ret;
+    }
+    // Blocks until some sessions wait for input that has not been given
+    // yet and returns them, or returns nothing once every session is done
+    vector<int> wait_for_input()
+    {
+        unique_lock<mutex> guard(lock);
+        event_cv.wait(guard, [this]() { return !blocked.empty() || running == 0; });
+        vector<int> ret;
+        ret.swap(blocked);
+        return ret;
+    }
+    uint64_t slices(int id)
+    {
+        lock_guard<mutex> guard(lock);
+        return sessions[id]->slices;
     }
 };
 
+#pragma region library
+// sipli.h
+namespace sipli
+{
+Program Program::compile(string_view source, int opt_level, string *errors)
+{
+    auto code = make_shared<CompiledProgram>();
+    code->source = string(source);
+    Program ret;
+    {
+        Interpreter compiler(code, false);
+        compiler.set_opt_level(opt_level);
+        if (errors)
+            compiler.set_error([errors](string_view text) { errors->append(text); });
+        if (compiler.load(code->source))
+            ret.code = code;
+    }
+    return ret;
+}
+
+// the program is only read from here on, an empty Program runs nothing
+Context::Context(const Program &program)
+    : impl(make_unique<Interpreter>(program.code ? const_pointer_cast<CompiledProgram>(program.code) : make_shared<CompiledProgram>(), true))
+{
+}
+Context::~Context() = default;
+Context::Context(Context &&) noexcept = default;
+Context &Context::operator=(Context &&) noexcept = default;
+
+void Context::on_output(function<void(string_view)> callback)
+{
+    impl->set_output(move(callback));
+}
+void Context::on_error(function<void(string_view)> callback)
+{
+    impl->set_error(move(callback));
+}
+void Context::on_input(function<bool(string &)> callback)
+{
+    impl->set_input(move(callback));
+}
+void Context::set_int(const string &name, int64_t value)
+{
+    impl->set_value(name, AbstractValue(value));
+}
+void Context::set_str(const string &name, const string &value)
+{
+    impl->set_text(name, value);
+}
+bool Context::get_int(const string &name, int64_t &value) const
+{
+    const AbstractValue *var = impl->value_of(name);
+    if (!var || var->getType() != INTEGER)
+        return false;
+    value = var->getAsInt();
+    return true;
+}
+bool Context::get_str(const string &name, string &value) const
+{
+    const AbstractValue *var = impl->value_of(name);
+    if (!var)
+        return false;
+    value = var->getAsString();
+    return true;
+}
+RunResult Context::run()
+{
+    if (!impl->run_shared())
+        return RunResult::EXIT;
+    return impl->was_stopped() ? RunResult::ERROR : RunResult::DONE;
+}
+void Context::reset()
+{
+    impl->reset_vars();
+}
+void Context::seed(uint64_t seed)
+{
+    impl->seed(seed);
+}
+} // namespace sipli
+#pragma endregion library
+
+#ifndef SIPLI_LIBRARY
+// SIGINT and SIGTERM with --snapshot-on-exit, a second signal kills the
+// process as usual
+static void request_stop(int sig)
+{
+    stop_requested = 1;
+    signal(sig, SIG_DFL);
+}
+
+// --show-snapshot: prints a snapshot like DMP does
+static bool print_snapshot(string_view data)
+{
+    SnapHeader header;
+    if (!read_snapshot_header(data, header))
+        return false;
+    const char *blob = data.data() + header.blob_offset;
+    auto str = [&](SnapStr ref) {
+        return snapshot_range(header, ref.off, ref.len, 1) ? string(blob + ref.off, ref.len) : string("?");
+    };
+    string vars_text, arrays_text;
+    for (size_t slot = 0; slot < header.var_count; slot++)
+    {
+        SnapVar rec;
+        memcpy(&rec, data.data() + header.vars_offset + slot * sizeof(SnapVar), sizeof(rec));
+        if (rec.type == INTEGER)
+            vars_text += "- " + str(rec.name) + " = " + to_string(rec.number) + "\n";
+        else if (rec.type == STRING)
+            vars_text += "- " + str(rec.name) + " = " + str(rec.text) + "\n";
+        if (rec.array_type == VOID)
+            continue;
+        size_t size = rec.array_type == INTEGER ? sizeof(int64_t) : sizeof(SnapStr);
+        if (!snapshot_range(header, rec.array_offset, rec.array_size, size))
+            return false;
+        arrays_text += "- " + str(rec.name) + "\n";
+        for (size_t e = 0; e < rec.array_size; e++)
+        {
+            if (rec.array_type == INTEGER)
+            {
+                int64_t number;
+                memcpy(&number, blob + rec.array_offset + e * size, size);
+                arrays_text += "| - " + to_string(number) + "\n";
+            }
+            else
+            {
+                SnapStr ref;
+                memcpy(&ref, blob + rec.array_offset + e * size, size);
+                arrays_text += "| - " + str(ref) + "\n";
+            }
+        }
+    }
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)header.program_hash);
+    cout << "## SNAPSHOT: program " << hash << ", continues at instruction " << header.ip + 1 << "\n"
+         << "## VARIABLES:\n" << vars_text << "## ARRAYS:\n" << arrays_text;
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
-    srand(time(0));
     string fpath;
     bool debug = 0;
+    bool legacy = 0;
+    bool stats = 0;
+    bool profile = 0;
+    bool trace = 0;
+    bool jit = 0;
+    bool seeded = 0;
+    uint64_t seed = 0;
+    string profile_out;
+    string batch;
+    BatchOptions batch_opt;
+    int sessions = 0;
+    uint64_t budget = 1000;
+    string session_input;
+    bool compile_only = 0;
+    bool use_cache = 1;
+    string cache_file;
+    string snapshot, resume, show_snapshot;
+    bool snapshot_on_exit = 0;
+    string metrics;
+    int metrics_interval = 1000;
+    FlushPolicy flush = FLUSH_AUTO;
     for (int argn = 1; argn < argc; argn++)
     {
         string sa = argv[argn];
@@ -614,6 +5091,164 @@ int main(int argc, char *argv[])
         {
             debug = 1;
         }
+        else if (sa == "--legacy")
+        {
+            legacy = 1;
+        }
+        else if (sa == "-O0" || sa == "-O1" || sa == "-O2")
+        {
+            batch_opt.opt_level = sa[2] - '0';
+        }
+        else if (sa == "--stats")
+        {
+            stats = 1;
+        }
+        else if (sa == "--trace")
+        {
+            trace = 1;
+        }
+        else if (sa == "--jit")
+        {
+            jit = 1;
+        }
+        else if (sa == "--compile")
+        {
+            compile_only = 1;
+        }
+        else if (sa == "--no-cache")
+        {
+            use_cache = 0;
+        }
+        else if (sa == "--snapshot-on-exit")
+        {
+            snapshot_on_exit = 1;
+        }
+        else if (sa == "--snapshot" || sa == "--resume" || sa == "--show-snapshot")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            string param = argv[argn + 1];
+            argn++;
+            if (sa == "--snapshot")
+                snapshot = param;
+            else if (sa == "--resume")
+                resume = param;
+            else
+                show_snapshot = param;
+        }
+        else if (sa == "--run-cache")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            cache_file = argv[argn + 1];
+            argn++;
+        }
+        else if (sa == "--metrics" || sa == "--metrics-interval")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            if (sa == "--metrics")
+                metrics = argv[argn + 1];
+            else
+                metrics_interval = max(10, atoi(argv[argn + 1]));
+            argn++;
+        }
+        else if (sa == "--sessions" || sa == "--budget" || sa == "--session-input")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            string param = argv[argn + 1];
+            argn++;
+            if (sa == "--sessions")
+                sessions = max(1, atoi(param.c_str()));
+            else if (sa == "--budget")
+                budget = max(1LL, atoll(param.c_str()));
+            else
+                session_input = param;
+        }
+        else if (sa == "--batch" || sa == "--jobs" || sa == "--batch-out")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            string param = argv[argn + 1];
+            argn++;
+            if (sa == "--batch")
+                batch = param;
+            else if (sa == "--batch-out")
+                batch_opt.out_dir = param;
+            else
+                batch_opt.jobs = atoi(param.c_str());
+        }
+        else if (sa == "--seed")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            try
+            {
+                seed = stoull(argv[argn + 1]);
+            }
+            catch (exception &e)
+            {
+                cerr << "Invalid seed: " << argv[argn + 1] << endl;
+                return 1;
+            }
+            seeded = 1;
+            argn++;
+        }
+        else if (sa == "--profile")
+        {
+            profile = 1;
+        }
+        else if (sa == "--profile-out")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            profile = 1;
+            profile_out = argv[argn + 1];
+            argn++;
+        }
+        else if (sa == "--flush")
+        {
+            if (argc <= argn + 1)
+            {
+                cerr << "Parameterized argument without parameter" << endl;
+                return 1;
+            }
+            string mode = argv[argn + 1];
+            argn++;
+            if (mode == "auto")
+                flush = FLUSH_AUTO;
+            else if (mode == "line")
+                flush = FLUSH_LINE;
+            else if (mode == "full")
+                flush = FLUSH_FULL;
+            else
+            {
+                cerr << "Unknown flush mode: " << mode << endl;
+                return 1;
+            }
+        }
         else if (sa == "-f" || sa == "--file")
         {
             if (argc <= argn + 1)
@@ -629,6 +5264,30 @@ int main(int argc, char *argv[])
             cout << "SIPLI argument list\n"
                  << "-h | --help        - show this message\n"
                  << "-f | --file [file] - run file\n"
+                 << "--legacy           - use the old string interpreter instead of the compiled one\n"
+                 << "-O0 | -O1 | -O2    - optimizer level: none, jump threading and unreachable code (default), + constants and dead stores\n"
+                 << "--compile          - write the compiled file (-f) to file.siplc and exit\n"
+                 << "--run-cache [f]    - run a .siplc file made by --compile, without its source\n"
+                 << "--no-cache         - do not use file.siplc next to the file (-f) even if it is up to date\n"
+                 << "--snapshot [f]     - file SNAP writes to (default: the file (-f) with .snap appended)\n"
+                 << "--snapshot-on-exit - also save a snapshot when the file ends, or stops on SIGINT/SIGTERM\n"
+                 << "--resume [f]       - restore a snapshot of the file (-f) and continue where it was taken\n"
+                 << "--show-snapshot [f] - print the variables and arrays in a snapshot\n"
+                 << "--flush [mode]     - output flushing: auto (per line on a terminal, default), line or full\n"
+                 << "--stats            - print parse time, run time and executed instruction count to stderr\n"
+                 << "--batch [dir|list] - run every .sipl file in dir, or every file listed in list, in parallel\n"
+                 << "--jobs [n]         - threads for --batch (default one per core)\n"
+                 << "--batch-out [dir]  - write each --batch script's output to dir/name.out and name.err\n"
+                 << "--sessions [n]     - run n interleaved copies of the file (-f) as sessions that suspend in INPT\n"
+                 << "--budget [n]       - lines a session runs before the next one gets a turn (default 1000)\n"
+                 << "--session-input [f] - lines of f are given to each session, one per INPT, then its input ends\n"
+                 << "--seed [n]         - seed RNG with n, runs with the same seed get the same numbers\n"
+                 << "--jit              - compile hot integer loops to native code (x86-64, off with -d, --trace and --profile)\n"
+                 << "--trace            - record the last 4096 executed instructions and print them on errors, DMP and at the end\n"
+                 << "--profile          - print the hottest lines and jumps to stderr when the file finishes\n"
+                 << "--profile-out [f]  - also write the profile to f, as JSON if f ends in .json, as collapsed stacks otherwise\n"
+                 << "--metrics [f]      - keep instruction, latency and memory metrics and rewrite f with them in Prometheus text format\n"
+                 << "--metrics-interval [ms] - how often --metrics rewrites f (default 1000), --jit is off with --metrics\n"
                  << "\n"
                  << "-d | --debug       - enable debug mode for extended debug debugging of debugger (obsolete (no))"
                  << endl;
@@ -640,29 +5299,200 @@ int main(int argc, char *argv[])
             return 0;
         }
     }
-    if (!fpath.empty())
+    if (!show_snapshot.empty())
     {
-        ifstream file(fpath);
-        if (!file.is_open())
+        SourceFile file;
+        if (!file.open(show_snapshot) || !print_snapshot(file.text()))
+        {
+            cerr << show_snapshot << " is not a snapshot of this SIPLI version" << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (snapshot_on_exit)
+    {
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+    }
+    if (!batch.empty())
+    {
+        vector<string> paths;
+        if (!BatchRunner::list_scripts(batch, paths))
+        {
+            cerr << "Could not open " << batch << endl;
+            return 1;
+        }
+        batch_opt.debug = debug;
+        batch_opt.legacy = legacy;
+        batch_opt.jit = jit;
+        batch_opt.trace = trace;
+        batch_opt.stats = stats;
+        batch_opt.seeded = seeded;
+        batch_opt.seed = seed;
+        return BatchRunner(batch_opt).run(paths) ? 1 : 0;
+    }
+    if (sessions && !fpath.empty())
+    {
+        // local harness for SessionScheduler, input is handed out only when
+        // a session blocks on it
+        SourceFile file;
+        if (!file.open(fpath))
+        {
+            cerr << "Could not open file.\n";
+            return 1;
+        }
+        vector<string> inputs;
+        if (!session_input.empty())
+        {
+            ifstream input_file(session_input);
+            if (!input_file)
+            {
+                cerr << "Could not open " << session_input << endl;
+                return 1;
+            }
+            string line;
+            while (getline(input_file, line))
+                inputs.push_back(line);
+        }
+        int jobs = batch_opt.jobs > 0 ? batch_opt.jobs : max(1u, thread::hardware_concurrency());
+        auto start = chrono::steady_clock::now();
+        uint64_t slices = 0;
+        {
+            SessionScheduler scheduler(jobs, budget);
+            for (int n = 0; n < sessions; n++)
+                scheduler.add(file.text(), debug, seeded, seed + n);
+            vector<size_t> next(sessions);
+            vector<int> waiting;
+            while (!(waiting = scheduler.wait_for_input()).empty())
+            {
+                for (int id : waiting)
+                {
+                    if (next[id] < inputs.size())
+                        scheduler.give_input(id, inputs[next[id]++]);
+                    else
+                        scheduler.close_input(id);
+                }
+            }
+            for (int n = 0; n < sessions; n++)
+            {
+                string text = scheduler.take_output(n);
+                string prefix = "[" + to_string(n) + "] ";
+                for (size_t pos = 0; pos < text.size();)
+                {
+                    size_t end = min(text.find('\n', pos), text.size());
+                    cout << prefix << string_view(text).substr(pos, end - pos) << '\n';
+                    pos = end + 1;
+                }
+                slices += scheduler.slices(n);
+            }
+            cout.flush();
+        }
+        cerr << "[SESSIONS] " << sessions << " sessions, " << jobs << " threads, budget " << budget << ", " << slices << " slices, "
+             << chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count() / 1e6 << " ms" << endl;
+        return 0;
+    }
+    if (!fpath.empty() || !cache_file.empty())
+    {
+        SourceFile file, cache, state;
+        if (!fpath.empty() && !file.open(fpath))
         {
             cerr << "Could not open file.\n";
             return 1;
         }
-        stringstream buffer;
-        buffer << file.rdbuf();
-        Interpreter x(debug);
-        x.run(buffer.str());
+        // a.sipl is compiled to a.siplc, anything else gets .siplc appended
+        string cache_path = cache_file.empty() ? fpath + (fpath.size() > 5 && fpath.substr(fpath.size() - 5) == ".sipl" ? "c" : ".siplc") : cache_file;
+        // only the REPL is interactive, a program that reads its input
+        // with INPT does not need cin synced with stdio or tied to cout
+        ios::sync_with_stdio(false);
+        cin.tie(nullptr);
+        Interpreter x(debug, legacy, flush);
+        x.set_opt_level(batch_opt.opt_level);
+        x.read_stdin();
+        if (profile)
+            x.enable_profiler();
+        if (trace)
+            x.enable_tracer();
+        if (jit && !x.enable_jit())
+            cerr << "--jit is not supported on this platform, ignoring it" << endl;
+        if (seeded)
+            x.seed(seed);
+        // destroyed before x, its last write sees the finished run
+        unique_ptr<MetricsExporter> exporter;
+        if (!metrics.empty())
+            exporter = make_unique<MetricsExporter>(x.enable_metrics(), metrics, metrics_interval);
+        uint64_t hash = fpath.empty() ? 0 : x.source_hash(file.text());
+        x.set_program_hash(hash);
+        x.set_snapshot(snapshot.empty() ? (fpath.empty() ? cache_file : fpath) + ".snap" : snapshot, snapshot_on_exit);
+        if (!resume.empty())
+        {
+            if (!state.open(resume))
+            {
+                cerr << "Could not open " << resume << endl;
+                return 1;
+            }
+            x.resume_from(state.text());
+        }
+        if (compile_only)
+        {
+            if (fpath.empty() || legacy)
+            {
+                cerr << "--compile needs a file (-f) and the compiled interpreter" << endl;
+                return 1;
+            }
+            if (!x.compile_program(file.text()) || !x.save_cache(cache_path, hash))
+            {
+                cerr << "Could not write " << cache_path << endl;
+                return 1;
+            }
+            return 0;
+        }
+        bool cached = 0;
+        if (!cache_file.empty())
+        {
+            if (cache.open(cache_file))
+                x.run_cache(cache.text(), 0, cached);
+            if (!cached)
+            {
+                cerr << cache_file << " is not a compiled file of this SIPLI version, recompile it with --compile" << endl;
+                return 1;
+            }
+        }
+        else if (use_cache && !legacy && cache.open(cache_path))
+        {
+            x.run_cache(cache.text(), hash, cached);
+        }
+        if (!cached)
+            x.run(file.text());
+        if (stats)
+            x.print_stats();
+        if (profile)
+        {
+            x.print_profile();
+            if (!profile_out.empty())
+                x.write_profile(profile_out, fpath.empty() ? cache_file : fpath);
+        }
     }
     else
     {
         cout << "SIPLI version " << SIPL_VER << SIPLI_APPENDIX << "\nUse HLP for help or pass -h argument for parameter list.\n";
-        Interpreter x(debug);
+        Interpreter x(debug, legacy, flush);
+        x.set_opt_level(batch_opt.opt_level);
+        if (jit && !x.enable_jit())
+            cerr << "--jit is not supported on this platform, ignoring it" << endl;
+        if (seeded)
+            x.seed(seed);
+        x.set_snapshot(snapshot, false);
+        unique_ptr<MetricsExporter> exporter;
+        if (!metrics.empty())
+            exporter = make_unique<MetricsExporter>(x.enable_metrics(), metrics, metrics_interval);
         while (1)
         {
             cout << ">>> ";
             string q;
-            getline(cin, q);
-            if (!x.run(q))
+            if (!getline(cin, q))
+                break;
+            // the old interpreter has no incremental mode, every input is a program of its own
+            if (!(legacy ? x.run(q) : x.run_appended(q)))
             {
                 break;
             }
@@ -671,3 +5501,4 @@ int main(int argc, char *argv[])
 
     return 0;
 }
+#endif
@@ -0,0 +1,87 @@
+// libsipli: run SIPL programs from C++.
+//
+// Build the library from main.cpp without its main():
+//   g++ -std=c++17 -O2 -pthread -DSIPLI_LIBRARY -c main.cpp -o sipli.o && ar rcs libsipli.a sipli.o
+//
+// A Program is compiled once and never changes, any number of Contexts on
+// any number of threads can run it at the same time. A Context holds the
+// variables of one caller and is used by one thread at a time.
+//
+//   sipli::Program rules = sipli::Program::compile(source);
+//   sipli::Context ctx(rules);
+//   ctx.set_int("amount", 250);
+//   ctx.run();
+//   int64_t fee;
+//   ctx.get_int("fee", fee);
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+struct CompiledProgram;
+class Interpreter;
+
+namespace sipli
+{
+// A compiled SIPL program
+class Program
+{
+public:
+    Program() = default;
+    // Compiles source with optimizer level opt_level (0-2, see -O). Errors
+    // found while compiling (an unknown label) are appended to errors, they
+    // do not stop the program from running. A program that can not run
+    // (a label defined twice) gives an empty Program.
+    static Program compile(std::string_view source, int opt_level = 1, std::string *errors = nullptr);
+    explicit operator bool() const
+    {
+        return code != nullptr;
+    }
+
+private:
+    std::shared_ptr<const CompiledProgram> code;
+    friend class Context;
+};
+
+enum class RunResult
+{
+    DONE,  // ran to the last line
+    EXIT,  // stopped at EXIT
+    ERROR  // stopped at an error, see on_error
+};
+
+// Variables and I/O for runs of a Program
+class Context
+{
+public:
+    explicit Context(const Program &program);
+    ~Context();
+    Context(Context &&) noexcept;
+    Context &operator=(Context &&) noexcept;
+
+    // Output and error text, in chunks of whole lines. Both are dropped
+    // until a callback is set.
+    void on_output(std::function<void(std::string_view text)> callback);
+    void on_error(std::function<void(std::string_view text)> callback);
+    // Called by INPT, returns false at the end of the input. Without a
+    // callback INPT fails.
+    void on_input(std::function<bool(std::string &line)> callback);
+
+    void set_int(const std::string &name, int64_t value);
+    void set_str(const std::string &name, const std::string &value);
+    // false if the variable is not defined, or for get_int, is not an INT
+    bool get_int(const std::string &name, int64_t &value) const;
+    // any variable, INT values are converted
+    bool get_str(const std::string &name, std::string &value) const;
+    // Runs the program from the first line. Variables keep their values
+    // between runs until reset().
+    RunResult run();
+    void reset();
+    void seed(uint64_t seed);
+
+private:
+    std::unique_ptr<Interpreter> impl;
+};
+} // namespace sipli
@@ -0,0 +1,24 @@
+// A Context without on_input must not read the host's stdin, INPT fails.
+//
+// g++ -std=c++17 -O2 -pthread -DSIPLI_LIBRARY -c main.cpp -o sipli.o
+// g++ -std=c++17 -O2 -pthread -I. tests/embed_no_input.cpp sipli.o -o embed_no_input
+// echo FROMSTDIN | ./embed_no_input   # prints "ok", exit code 0
+#include <iostream>
+#include "sipli.h"
+
+int main()
+{
+    sipli::Program program = sipli::Program::compile("INPT line;\nPRNT got $line;\n");
+    sipli::Context ctx(program);
+    std::string printed;
+    ctx.on_output([&printed](std::string_view text) { printed += text; });
+    sipli::RunResult result = ctx.run();
+    std::string line;
+    if (result != sipli::RunResult::ERROR || !printed.empty() || ctx.get_str("line", line))
+    {
+        std::cout << "INPT read input without on_input: " << printed << std::endl;
+        return 1;
+    }
+    std::cout << "ok" << std::endl;
+    return 0;
+}